@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+"""
+Load generator for lorawanatd.
+
+Drives /send, /sendb, /config/get and /status from many concurrent
+connections and reports throughput and latency percentiles per endpoint.
+Downlink delivery latency on the push socket is measured when the firmware
+emulator stamps its payloads, e.g.
+
+    tools/atslave_emu -o /tmp/ttyEMU -t -d 500 &
+    lorawanatd -f /tmp/ttyEMU
+    scripts/test/load_test.py -c 32 -d 30
+
+By default every request has a connection of its own. -k keeps each
+client's connection alive, -P n pipelines n requests at a time on it, and
+-a p walks away from a connection mid-reply with probability p, leaving
+the rest of its replies unread:
+
+    scripts/test/load_test.py -c 32 -P 4 -a 0.05
+"""
+import argparse
+import asyncio
+import json
+import random
+import re
+import time
+
+ENDPOINTS = {
+    'status': ('GET', '/status', None),
+    'config_get': ('POST', '/config/get', json.dumps(['data_rate', 'class', 'adaptive_data_rate'])),
+    'send': ('POST', '/send', json.dumps({'data': 'hello', 'port': 21})),
+    'sendb': ('POST', '/sendb', json.dumps({'data': 'aabbccddee', 'port': 21})),
+}
+
+PUSH_RX = re.compile(rb'<rx=(\d+),([0-9a-fA-F]*),[^>]*>')
+
+
+class Stats:
+    def __init__(self):
+        self.latencies = []
+        self.errors = 0
+        self.aborts = 0
+
+    def add(self, latency, ok):
+        self.latencies.append(latency)
+        if not ok:
+            self.errors += 1
+
+
+def percentile(values, p):
+    """Nearest rank percentile of a sorted list."""
+    if not values:
+        return float('nan')
+    rank = max(0, min(len(values) - 1, int(round(p / 100.0 * len(values) + 0.5)) - 1))
+    return values[rank]
+
+
+ERRORS = (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError, ValueError, IndexError)
+
+
+def encode(host, method, path, body, close):
+    head = '{} {} HTTP/1.1\r\nHost: {}\r\n'.format(method, path, host)
+    if body is not None:
+        head += 'Content-Type: application/json\r\nContent-Length: {}\r\n'.format(len(body))
+    if close:
+        head += 'Connection: close\r\n'
+    head += '\r\n'
+    return head.encode() + (body.encode() if body else b'')
+
+
+async def read_reply(reader, timeout):
+    """Reads one reply off the connection, returns its status."""
+    header = b''
+    while True:
+        line = await asyncio.wait_for(reader.readline(), timeout)
+        if not line:
+            raise asyncio.IncompleteReadError(header, None)
+        if line == b'\r\n':
+            break
+        header += line
+    status = int(header.split(b' ', 2)[1])
+    length = re.search(rb'(?i)content-length:\s*(\d+)', header)
+    if length:
+        await asyncio.wait_for(reader.readexactly(int(length.group(1))), timeout)
+    else:
+        await asyncio.wait_for(reader.read(), timeout)
+    return status
+
+
+async def request(host, port, method, path, body, timeout):
+    reader, writer = await asyncio.wait_for(asyncio.open_connection(host, port), timeout)
+    try:
+        writer.write(encode(host, method, path, body, True))
+        await writer.drain()
+        return await read_reply(reader, timeout)
+    finally:
+        writer.close()
+
+
+async def client(args, mix, stats, deadline):
+    """Sends args.pipeline requests at a time and reads their replies in order."""
+    names = [name for name, _ in mix]
+    weights = [weight for _, weight in mix]
+    keep_alive = args.keep_alive or args.pipeline > 1
+    conn = None
+    while time.monotonic() < deadline:
+        batch = random.choices(names, weights, k=args.pipeline)
+        done = 0
+        start = time.monotonic()
+        try:
+            if conn is None:
+                conn = await asyncio.wait_for(asyncio.open_connection(args.host, args.port), args.timeout)
+            reader, writer = conn
+            writer.write(b''.join(encode(args.host, *ENDPOINTS[name], not keep_alive) for name in batch))
+            await writer.drain()
+            for name in batch:
+                if args.abort and random.random() < args.abort:
+                    # Gone once the reply has started, the rest is left unread
+                    await asyncio.wait_for(reader.read(1), args.timeout)
+                    for left in batch[done:]:
+                        stats[left].aborts += 1
+                    writer.close()
+                    conn = None
+                    break
+                status = await read_reply(reader, args.timeout)
+                stats[name].add(time.monotonic() - start, status == 200)
+                done += 1
+        except ERRORS:
+            for name in batch[done:]:
+                stats[name].add(time.monotonic() - start, False)
+            if conn:
+                conn[1].close()
+            conn = None
+        if conn and not keep_alive:
+            conn[1].close()
+            conn = None
+    if conn:
+        conn[1].close()
+
+
+async def push_listener(args, push_stats, deadline):
+    """Downlink payloads stamped by the emulator (-t) carry CLOCK_MONOTONIC in us."""
+    try:
+        reader, writer = await asyncio.open_connection(args.host, args.push_port)
+    except OSError as e:
+        print('push socket: {}'.format(e))
+        return
+    buf = b''
+    while time.monotonic() < deadline:
+        try:
+            data = await asyncio.wait_for(reader.read(4096), max(0.01, deadline - time.monotonic()))
+        except asyncio.TimeoutError:
+            break
+        if not data:
+            break
+        now = time.monotonic()
+        buf += data
+        while True:
+            m = PUSH_RX.search(buf)
+            if not m:
+                break
+            buf = buf[m.end():]
+            if len(m.group(2)) == 16:
+                push_stats.add(now - int(m.group(2), 16) / 1e6, True)
+            else:
+                push_stats.add(float('nan'), True)
+    writer.close()
+
+
+def report(name, stats, elapsed):
+    values = sorted(v for v in stats.latencies if v == v)
+    print('{:<12} {:>8} {:>7} {:>7} {:>9.1f} {:>9.1f} {:>9.1f} {:>9.1f}'.format(
+        name, len(stats.latencies), stats.errors, stats.aborts, len(stats.latencies) / elapsed,
+        percentile(values, 50) * 1e3, percentile(values, 99) * 1e3,
+        percentile(values, 99.9) * 1e3))
+
+
+def parse_mix(spec):
+    mix = []
+    for item in spec.split(','):
+        name, _, weight = item.partition('=')
+        if name not in ENDPOINTS:
+            raise argparse.ArgumentTypeError('unknown endpoint {}'.format(name))
+        mix.append((name, float(weight or 1)))
+    return mix
+
+
+async def main(args):
+    if args.join:
+        try:
+            await request(args.host, args.port, 'GET', '/join', None, 70)
+        except (OSError, asyncio.TimeoutError) as e:
+            print('join: {}'.format(e))
+
+    stats = {name: Stats() for name, _ in args.mix}
+    push_stats = Stats()
+
+    start = time.monotonic()
+    deadline = start + args.duration
+    tasks = [client(args, args.mix, stats, deadline) for _ in range(args.connections)]
+    tasks.append(push_listener(args, push_stats, deadline))
+    await asyncio.gather(*tasks)
+    elapsed = time.monotonic() - start
+
+    print('{} connections, {}, {:.1f}s'.format(
+        args.connections, 'pipelined by {}'.format(args.pipeline) if args.pipeline > 1 else
+        'keep-alive' if args.keep_alive else 'one request each', elapsed))
+    print('{:<12} {:>8} {:>7} {:>7} {:>9} {:>9} {:>9} {:>9}'.format(
+        'endpoint', 'requests', 'errors', 'aborts', 'req/s', 'p50 ms', 'p99 ms', 'p999 ms'))
+    total = Stats()
+    for name, _ in args.mix:
+        report(name, stats[name], elapsed)
+        total.latencies += stats[name].latencies
+        total.errors += stats[name].errors
+        total.aborts += stats[name].aborts
+    report('total', total, elapsed)
+    if push_stats.latencies:
+        report('push', push_stats, elapsed)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('-p', '--port', type=int, default=5555)
+    parser.add_argument('--push-port', type=int, default=6666)
+    parser.add_argument('-c', '--connections', type=int, default=16, help='concurrent clients')
+    parser.add_argument('-d', '--duration', type=float, default=10, help='seconds')
+    parser.add_argument('-t', '--timeout', type=float, default=70, help='per request, seconds')
+    parser.add_argument('-m', '--mix', type=parse_mix, default=parse_mix('status,config_get,send,sendb'),
+                        help='endpoint=weight,... of status, config_get, send, sendb')
+    parser.add_argument('-k', '--keep-alive', action='store_true', help='reuse one connection per client')
+    parser.add_argument('-P', '--pipeline', type=int, default=1,
+                        help='requests sent back to back on a kept alive connection')
+    parser.add_argument('-a', '--abort', type=float, default=0,
+                        help='probability of closing a connection mid-reply')
+    parser.add_argument('--no-join', dest='join', action='store_false', help='skip the initial /join')
+    asyncio.run(main(parser.parse_args()))
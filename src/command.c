@@ -6,29 +6,33 @@
 #include <assert.h>
 #include <regex.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include "command.h"
 #include "util.h"
 #include "logger.h"
 #include "push.h"
+#include "uart.h"
 
-#define DEFAULT_TIMEOUT 15
+#define DEFAULT_TIMEOUT 15000 /* ms */
 /* AT_SLAVE has \r\n and \n\r used interchangebly.
 */
 #define RX_NEWLINE 		"\r\n"
 
-#define JOINED_RESPONSE "+EVT:JOINED\r\n"
-#define JOIN_FAILED_RESPONSE "+EVT:JOIN FAILED\r\n"
+#define EVT_PREFIX "+EVT:"
 
-/* Construct the cmds function defs */
-char * construct_raw_cmd(struct command *cmd);
-char * construct_get_cmd(struct command *cmd);
-char * construct_set_cmd(struct command *cmd);
-char * construct_send_cmd(struct command *cmd);
-char * construct_join_cmd(struct command *cmd);
-char * construct_context_restore_cmd(struct command *cmd);
-char * construct_mac_param_cmd(struct command *cmd);
-char * construct_delay_cmd(struct command *cmd);
-char * construct_force_update_cmd(struct command *cmd);
+/* Local command replies, written into the command buffer */
+size_t construct_mac_param_cmd(struct command *cmd, char *buf, size_t size);
+size_t construct_delay_cmd(struct command *cmd, char *buf, size_t size);
+size_t construct_force_update_cmd(struct command *cmd, char *buf, size_t size);
+size_t construct_param_error_cmd(struct command *cmd, char *buf, size_t size);
+
+/* Scatter-gather constructors, segments point at the request buffer */
+int construct_raw_iov(struct command *cmd, struct uart_tx *tx);
+int construct_get_iov(struct command *cmd, struct uart_tx *tx);
+int construct_join_iov(struct command *cmd, struct uart_tx *tx);
+int construct_set_iov(struct command *cmd, struct uart_tx *tx);
+int construct_send_iov(struct command *cmd, struct uart_tx *tx);
+int construct_context_restore_iov(struct command *cmd, struct uart_tx *tx);
 
 /* Process the rx function defs */
 enum cmd_res_code wait_for_ok(struct command *cmd);
@@ -38,15 +42,16 @@ enum cmd_res_code wait_for_joined_or_timeout(struct command *cmd);
 enum cmd_res_code wait_for_ok_or_timeout(struct command *cmd);
 
 /* Async response processors */
-void async_recv(struct lrwanatd *lw, char *buf, size_t buflen);
-void async_has_more_tx(struct lrwanatd *lw, char *buf, size_t buflen);
+void async_recv(struct lrwanatd *lw, struct async_evt *evt);
+void async_has_more_tx(struct lrwanatd *lw, struct async_evt *evt);
+void async_join_evt(struct lrwanatd *lw, struct async_evt *evt);
 
 /* Local commands */
-char * get_njm_cmd(struct command *cmd);
-char * get_cfm_cmd(struct command *cmd);
+size_t get_njm_cmd(struct command *cmd, char *buf, size_t size);
+size_t get_cfm_cmd(struct command *cmd, char *buf, size_t size);
 
-char * set_njm_cmd(struct command *cmd);
-char * set_cfm_cmd(struct command *cmd);
+size_t set_njm_cmd(struct command *cmd, char *buf, size_t size);
+size_t set_cfm_cmd(struct command *cmd, char *buf, size_t size);
 
 
 char *response[] = {
@@ -59,962 +64,561 @@ char *response[] = {
 
 char *delay_msg = "\r\n\r\n";
 
-struct command_def cmd_def_list[] = {
-	{
-		.type = CMD_RESET,
-		.group = CMD_ACTION,
-		.token = TOKEN_AT_RESET,
-		.token_len = sizeof(TOKEN_AT_RESET) - 1,
-		.cmd = AT_CMD_RESET,
-		.cmd_len = sizeof(AT_CMD_RESET) - 1,
-		.construct_cmd = construct_raw_cmd,
-		.process_cmd = wait_for_good_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_HARD_RESET,
-		.group = CMD_ACTION,
-		.token = TOKEN_AT_HARD_RESET,
-		.token_len = sizeof(TOKEN_AT_HARD_RESET) - 1,
-		.cmd = AT_CMD_RESET,
-		.cmd_len = sizeof(AT_CMD_RESET) - 1,
-		.construct_cmd = construct_raw_cmd,
-		.process_cmd = wait_for_good_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_STATUS,
-		.group = CMD_ACTION,
-		.token = TOKEN_AT,
-		.token_len = sizeof(TOKEN_AT) - 1,
-		.cmd = AT_CMD,
-		.cmd_len = sizeof(AT_CMD) - 1,
-		.construct_cmd = construct_raw_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_JOIN,
-		.group = CMD_ACTION,
-		.token = TOKEN_AT_JOIN,
-		.token_len = sizeof(TOKEN_AT_JOIN) - 1,
-		.cmd = AT_CMD_JOIN,
-		.cmd_len = sizeof(AT_CMD_JOIN) - 1,
-		.construct_cmd = construct_join_cmd,
-		.process_cmd = wait_for_joined_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_DEUI,
-		.group = CMD_GET,
-		.token = TOKEN_AT_DEUI,
-		.token_len = sizeof(TOKEN_AT_DEUI) - 1,
-		.cmd = AT_CMD_DEUI,
-		.cmd_len = sizeof(AT_CMD_DEUI) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_DADDR,
-		.group = CMD_GET,
-		.token = TOKEN_AT_DADDR,
-		.token_len = sizeof(TOKEN_AT_DADDR) - 1,
-		.cmd = AT_CMD_DADDR,
-		.cmd_len = sizeof(AT_CMD_DADDR) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_APPKEY,
-		.group = CMD_GET,
-		.token = TOKEN_AT_APPKEY,
-		.token_len = sizeof(TOKEN_AT_APPKEY) - 1,
-		.cmd = AT_CMD_APPKEY,
-		.cmd_len = sizeof(AT_CMD_APPKEY) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_APPEUI,
-		.group = CMD_GET,
-		.token = TOKEN_AT_APPEUI,
-		.token_len = sizeof(TOKEN_AT_APPEUI) - 1,
-		.cmd = AT_CMD_APPEUI,
-		.cmd_len = sizeof(AT_CMD_APPEUI) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_ADR,
-		.group = CMD_GET,
-		.token = TOKEN_AT_ADR,
-		.token_len = sizeof(TOKEN_AT_ADR) - 1,
-		.cmd = AT_CMD_ADR,
-		.cmd_len = sizeof(AT_CMD_ADR) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_TXP,
-		.group = CMD_GET,
-		.token = TOKEN_AT_TXP,
-		.token_len = sizeof(TOKEN_AT_TXP) - 1,
-		.cmd = AT_CMD_TXP,
-		.cmd_len = sizeof(AT_CMD_TXP) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_DR,
-		.group = CMD_GET,
-		.token = TOKEN_AT_DR,
-		.token_len = sizeof(TOKEN_AT_DR) - 1,
-		.cmd = AT_CMD_DR,
-		.cmd_len = sizeof(AT_CMD_DR) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_RX2FQ,
-		.group = CMD_GET,
-		.token = TOKEN_AT_RX2FQ,
-		.token_len = sizeof(TOKEN_AT_RX2FQ) - 1,
-		.cmd = AT_CMD_RX2FQ,
-		.cmd_len = sizeof(AT_CMD_RX2FQ) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_RX2DR,
-		.group = CMD_GET,
-		.token = TOKEN_AT_RX2DR,
-		.token_len = sizeof(TOKEN_AT_RX2DR) - 1,
-		.cmd = AT_CMD_RX2DR,
-		.cmd_len = sizeof(AT_CMD_RX2DR) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_RX1DL,
-		.group = CMD_GET,
-		.token = TOKEN_AT_RX1DL,
-		.token_len = sizeof(TOKEN_AT_RX1DL) - 1,
-		.cmd = AT_CMD_RX1DL,
-		.cmd_len = sizeof(AT_CMD_RX1DL) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_RX2DL,
-		.group = CMD_GET,
-		.token = TOKEN_AT_RX2DL,
-		.token_len = sizeof(TOKEN_AT_RX2DL) - 1,
-		.cmd = AT_CMD_RX2DL,
-		.cmd_len = sizeof(AT_CMD_RX2DL) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_JN1DL,
-		.group = CMD_GET,
-		.token = TOKEN_AT_JN1DL,
-		.token_len = sizeof(TOKEN_AT_JN1DL) - 1,
-		.cmd = AT_CMD_JN1DL,
-		.cmd_len = sizeof(AT_CMD_JN1DL) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_JN2DL,
-		.group = CMD_GET,
-		.token = TOKEN_AT_JN2DL,
-		.token_len = sizeof(TOKEN_AT_JN2DL) - 1,
-		.cmd = AT_CMD_JN2DL,
-		.cmd_len = sizeof(AT_CMD_JN2DL) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_NJM,
-		.group = CMD_GET,
-		.token = TOKEN_AT_NJM,
-		.token_len = sizeof(TOKEN_AT_NJM) - 1,
-		.cmd = AT_CMD_NJM,
-		.cmd_len = sizeof(AT_CMD_NJM) - 1,
-		.construct_cmd = get_njm_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_GET_NWKID,
-		.group = CMD_GET,
-		.token = TOKEN_AT_NWKID,
-		.token_len = sizeof(TOKEN_AT_NWKID) - 1,
-		.cmd = AT_CMD_NWKID,
-		.cmd_len = sizeof(AT_CMD_NWKID) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_CLASS,
-		.group = CMD_GET,
-		.token = TOKEN_AT_CLASS,
-		.token_len = sizeof(TOKEN_AT_CLASS) - 1,
-		.cmd = AT_CMD_CLASS,
-		.cmd_len = sizeof(AT_CMD_CLASS) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_NJS,
-		.group = CMD_GET,
-		.token = TOKEN_AT_NJS,
-		.token_len = sizeof(TOKEN_AT_NJS) - 1,
-		.cmd = AT_CMD_NJS,
-		.cmd_len = sizeof(AT_CMD_NJS) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_CFM,
-		.group = CMD_GET,
-		.token = TOKEN_AT_CFM,
-		.token_len = sizeof(TOKEN_AT_CFM) - 1,
-		.cmd = AT_CMD_CFM,
-		.cmd_len = sizeof(AT_CMD_CFM) - 1,
-		.construct_cmd = get_cfm_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_GET_CFS,
-		.group = CMD_GET,
-		.token = TOKEN_AT_CFS,
-		.token_len = sizeof(TOKEN_AT_CFS) - 1,
-		.cmd = AT_CMD_CFS,
-		.cmd_len = sizeof(AT_CMD_CFS) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_SNR,
-		.group = CMD_GET,
-		.token = TOKEN_AT_SNR,
-		.token_len = sizeof(TOKEN_AT_SNR) - 1,
-		.cmd = AT_CMD_SNR,
-		.cmd_len = sizeof(AT_CMD_SNR) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_GET_RSSI,
-		.group = CMD_GET,
-		.token = TOKEN_AT_RSSI,
-		.token_len = sizeof(TOKEN_AT_RSSI) - 1,
-		.cmd = AT_CMD_RSSI,
-		.cmd_len = sizeof(AT_CMD_RSSI) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_DADDR,
-		.group = CMD_SET,
-		.token = TOKEN_AT_DADDR,
-		.token_len = sizeof(TOKEN_AT_DADDR) - 1,
-		.cmd = AT_CMD_DADDR,
-		.cmd_len = sizeof(AT_CMD_DADDR) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_APPKEY,
-		.group = CMD_SET,
-		.token = TOKEN_AT_APPKEY,
-		.token_len = sizeof(TOKEN_AT_APPKEY) - 1,
-		.cmd = AT_CMD_APPKEY,
-		.cmd_len = sizeof(AT_CMD_APPKEY) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_NWKSKEY,
-		.group = CMD_SET,
-		.token = TOKEN_AT_NWKSKEY,
-		.token_len = sizeof(TOKEN_AT_NWKSKEY) - 1,
-		.cmd = AT_CMD_NWKSKEY,
-		.cmd_len = sizeof(AT_CMD_NWKSKEY) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_APPSKEY,
-		.group = CMD_SET,
-		.token = TOKEN_AT_APPSKEY,
-		.token_len = sizeof(TOKEN_AT_APPSKEY) - 1,
-		.cmd = AT_CMD_APPSKEY,
-		.cmd_len = sizeof(AT_CMD_APPSKEY) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_APPEUI,
-		.group = CMD_SET,
-		.token = TOKEN_AT_APPEUI,
-		.token_len = sizeof(TOKEN_AT_APPEUI) - 1,
-		.cmd = AT_CMD_APPEUI,
-		.cmd_len = sizeof(AT_CMD_APPEUI) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_ADR,
-		.group = CMD_SET,
-		.token = TOKEN_AT_ADR,
-		.token_len = sizeof(TOKEN_AT_ADR) - 1,
-		.cmd = AT_CMD_ADR,
-		.cmd_len = sizeof(AT_CMD_ADR) - 1,
-		.construct_cmd = construct_mac_param_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-        .local_state = true,
-	},
-	{
-		.type = CMD_SET_TXP,
-		.group = CMD_SET,
-		.token = TOKEN_AT_TXP,
-		.token_len = sizeof(TOKEN_AT_TXP) - 1,
-		.cmd = AT_CMD_TXP,
-		.cmd_len = sizeof(AT_CMD_TXP) - 1,
-		.construct_cmd = construct_mac_param_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_SET_DR,
-		.group = CMD_SET,
-		.token = TOKEN_AT_DR,
-		.token_len = sizeof(TOKEN_AT_DR) - 1,
-		.cmd = AT_CMD_DR,
-		.cmd_len = sizeof(AT_CMD_DR) - 1,
-		.construct_cmd = construct_mac_param_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_SET_RX2FQ,
-		.group = CMD_SET,
-		.token = TOKEN_AT_RX2FQ,
-		.token_len = sizeof(TOKEN_AT_RX2FQ) - 1,
-		.cmd = AT_CMD_RX2FQ,
-		.cmd_len = sizeof(AT_CMD_RX2FQ) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_RX2DR,
-		.group = CMD_SET,
-		.token = TOKEN_AT_RX2DR,
-		.token_len = sizeof(TOKEN_AT_RX2DR) - 1,
-		.cmd = AT_CMD_RX2DR,
-		.cmd_len = sizeof(AT_CMD_RX2DR) - 1,
-		.construct_cmd = construct_mac_param_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_SET_RX1DL,
-		.group = CMD_SET,
-		.token = TOKEN_AT_RX1DL,
-		.token_len = sizeof(TOKEN_AT_RX1DL) - 1,
-		.cmd = AT_CMD_RX1DL,
-		.cmd_len = sizeof(AT_CMD_RX1DL) - 1,
-		.construct_cmd = construct_mac_param_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_SET_RX2DL,
-		.group = CMD_SET,
-		.token = TOKEN_AT_RX2DL,
-		.token_len = sizeof(TOKEN_AT_RX2DL) - 1,
-		.cmd = AT_CMD_RX2DL,
-		.cmd_len = sizeof(AT_CMD_RX2DL) - 1,
-		.construct_cmd = construct_mac_param_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_SET_JN1DL,
-		.group = CMD_SET,
-		.token = TOKEN_AT_JN1DL,
-		.token_len = sizeof(TOKEN_AT_JN1DL) - 1,
-		.cmd = AT_CMD_JN1DL,
-		.cmd_len = sizeof(AT_CMD_JN1DL) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_JN2DL,
-		.group = CMD_SET,
-		.token = TOKEN_AT_JN2DL,
-		.token_len = sizeof(TOKEN_AT_JN2DL) - 1,
-		.cmd = AT_CMD_JN2DL,
-		.cmd_len = sizeof(AT_CMD_JN2DL) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_NJM,
-		.group = CMD_SET,
-		.token = TOKEN_AT_NJM,
-		.token_len = sizeof(TOKEN_AT_NJM) - 1,
-		.cmd = AT_CMD_NJM,
-		.cmd_len = sizeof(AT_CMD_NJM) - 1,
-		.construct_cmd = set_njm_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_SET_NWKID,
-		.group = CMD_SET,
-		.token = TOKEN_AT_NWKID,
-		.token_len = sizeof(TOKEN_AT_NWKID) - 1,
-		.cmd = AT_CMD_NWKID,
-		.cmd_len = sizeof(AT_CMD_NWKID) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_CLASS,
-		.group = CMD_SET,
-		.token = TOKEN_AT_CLASS,
-		.token_len = sizeof(TOKEN_AT_CLASS) - 1,
-		.cmd = AT_CMD_CLASS,
-		.cmd_len = sizeof(AT_CMD_CLASS) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SET_CFM,
-		.group = CMD_SET,
-		.token = TOKEN_AT_CFM,
-		.token_len = sizeof(TOKEN_AT_CFM) - 1,
-		.cmd = AT_CMD_CFM,
-		.cmd_len = sizeof(AT_CMD_CFM) - 1,
-		.construct_cmd = set_cfm_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_SET_FCNT,
-		.group = CMD_SET,
-		.token = TOKEN_AT_FCNT,
-		.token_len = sizeof(TOKEN_AT_FCNT) - 1,
-		.cmd = AT_CMD_FCNT,
-		.cmd_len = sizeof(AT_CMD_FCNT) - 1,
-		.construct_cmd = construct_set_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SEND_TEXT,
-		.group = CMD_SEND,
-		.token = TOKEN_AT_SEND,
-		.token_len = sizeof(TOKEN_AT_SEND) - 1,
-		.cmd = AT_CMD_SEND,
-		.cmd_len = sizeof(AT_CMD_SEND) - 1,
-		.construct_cmd = construct_send_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_SEND_BINARY,
-		.group = CMD_SEND,
-		.token = TOKEN_AT_SENDB,
-		.token_len = sizeof(TOKEN_AT_SENDB) - 1,
-		.cmd = AT_CMD_SENDB,
-		.cmd_len = sizeof(AT_CMD_SENDB) - 1,
-		.construct_cmd = construct_send_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_ASYNC_RECV,
-		.group = CMD_ASYNC,
-		.token = NULL,
-		.token_len = 0,
-		.cmd = NULL,
-		.cmd_len = 0,
-		.construct_cmd = NULL,
-		.process_cmd = NULL,
-		.async_cmd = async_recv,
-	},
-	{
-		.type = CMD_ASYNC_MORE_TX,
-		.group = CMD_ASYNC,
-		.token = NULL,
-		.token_len = 0,
-		.cmd = NULL,
-		.cmd_len = 0,
-		.construct_cmd = NULL,
-		.process_cmd = NULL,
-		.async_cmd = async_has_more_tx,
-	},
-	{
-		.type = CMD_ACQUIRE_CONTEXT,
-		.group = CMD_INTERNAL,
-		.token = TOKEN_AT_CTX_ACQ,
-		.token_len = sizeof(TOKEN_AT_CTX_ACQ) - 1,
-		.cmd = AT_CMD_CTX,
-		.cmd_len = sizeof(AT_CMD_CTX) - 1,
-		.construct_cmd = construct_get_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_RESTORE_CONTEXT,
-		.group = CMD_INTERNAL,
-		.token = TOKEN_AT_CTX_RES,
-		.token_len = sizeof(TOKEN_AT_CTX_RES) - 1,
-		.cmd = AT_CMD,
-		.cmd_len = sizeof(AT_CMD) - 1,
-		.construct_cmd = construct_context_restore_cmd,
-		.process_cmd = wait_for_ok_or_timeout,
-		.async_cmd = NULL,
-	},
-	{
-		.type = CMD_DELAY,
-		.group = CMD_INTERNAL,
-		.token = TOKEN_AT_DELAY,
-		.token_len = sizeof(TOKEN_AT_DELAY) - 1,
-		.cmd = AT_CMD_DELAY,
-		.cmd_len = sizeof(AT_CMD_DELAY) - 1,
-		.construct_cmd = construct_delay_cmd,
-		.process_cmd = wait_for_good_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
-	{
-		.type = CMD_FORCE_UPDATE,
-		.group = CMD_INTERNAL,
-		.token = TOKEN_AT_FORCE_UPDATE,
-		.token_len = sizeof(TOKEN_AT_FORCE_UPDATE) - 1,
-		.cmd = AT_CMD_FORCE_UPDATE,
-		.cmd_len = sizeof(AT_CMD_FORCE_UPDATE) - 1,
-		.construct_cmd = construct_force_update_cmd,
-		.process_cmd = wait_for_good_timeout,
-		.async_cmd = NULL,
-		.local_state = true,
-	},
+/* Complete lines recognised by the tokenizer, see classify_at_line */
+struct at_line_def {
+	const char *str;
+	size_t len;
+	enum at_res_type type;
 };
 
+#define AT_LINE(s, t) { s, sizeof(s) - 1, t }
 
-time_t get_epoc_timeout(struct command *cmd)
-{
-	return cmd->timeout + time(NULL);
-}
+struct at_line_def at_status_lines[] = {
+	AT_LINE("OK", AT_RES_OK),
+	AT_LINE("AT_PARAM_ERROR", AT_RES_PARAM_ERROR),
+	AT_LINE("AT_ERROR", AT_RES_ERROR),
+	AT_LINE("AT_BUSY_ERROR", AT_RES_BUSY_ERROR),
+	AT_LINE("AT_NO_NETWORK_JOINED", AT_RES_NO_NETWORK_JOINED),
+};
 
-char *construct_raw_cmd(struct command *cmd)
-{
-	char *buf, *strptr;
-	size_t buflen;
+struct at_line_def at_evt_lines[] = {
+	AT_LINE("JOINED", AT_RES_EVT_JOINED),
+	AT_LINE("JOIN FAILED", AT_RES_EVT_JOIN_FAILED),
+};
 
-	buflen = cmd->def.cmd_len + 1;
+/* Indexed by type, see command_spec.h */
+#define CMD_DEF(_type, _group, _token, _cmd, _construct_cmd, _construct_iov, \
+		_process_cmd, _async_cmd, _local_state, _check) \
+	{ \
+		.type = _type, \
+		.group = _group, \
+		.token = _token, \
+		.token_len = sizeof(_token) - 1, \
+		.cmd = _cmd, \
+		.cmd_len = sizeof(_cmd) - 1, \
+		.cmd_get = _cmd "=?", \
+		.cmd_get_len = sizeof(_cmd "=?") - 1, \
+		.cmd_set = _cmd "=", \
+		.cmd_set_len = sizeof(_cmd "=") - 1, \
+		.construct_cmd = _construct_cmd, \
+		.construct_iov = _construct_iov, \
+		.process_cmd = _process_cmd, \
+		.async_cmd = _async_cmd, \
+		.local_state = _local_state, \
+		.check = _check, \
+	},
 
-	buf = malloc(buflen);
+struct command_def cmd_def_list[CMD_TYPE_MAX] = {
+	CMD_SPEC(CMD_DEF)
+};
 
-	strptr = buf;
+/*	Token lookup. The (token, group) pairs of cmd_def_list hash into
+ *	distinct slots, so a lookup is one hash and one compare. The table is
+ *	built at startup; CMD_HASH_SEED is known to be collision free for the
+ *	commands listed, other seeds are only tried if the list changed.
+ */
+#define CMD_HASH_SIZE 256
+#define CMD_HASH_SEED 58
+#define CMD_HASH_TRIES 100000
 
-	strncpy(strptr, cmd->def.cmd, cmd->def.cmd_len);
-	strptr += cmd->def.cmd_len;
+uint8_t cmd_hash[CMD_HASH_SIZE]; /* type + 1, 0 when empty */
+uint32_t cmd_hash_seed;
 
-	*strptr = '\0';
+/* FNV-1a over the token, then the group */
+uint32_t hash_cmd_token(const char *token, size_t len, enum cmd_group group, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ seed;
+	size_t i;
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)token[i];
+		h *= 16777619u;
+	}
+	h ^= group;
+	h *= 16777619u;
 
-	return buf;
+	return h & (CMD_HASH_SIZE - 1);
 }
 
-char *construct_join_cmd(struct command *cmd)
+int init_cmd_defs()
 {
-	char *buf, *strptr;
-	size_t buflen;
-
-	buflen = cmd->def.cmd_len /* AT+JOIN */ + 2 /* =[0/1] */;
-
-	buf = malloc(buflen + 1);
+	struct command_def *def;
+	uint32_t seed, slot;
+	enum cmd_type type;
+
+	for (seed = CMD_HASH_SEED; seed < CMD_HASH_SEED + CMD_HASH_TRIES; seed++) {
+		memset(cmd_hash, 0, sizeof(cmd_hash));
+		for (type = 0; type < CMD_TYPE_MAX; type++) {
+			def = &cmd_def_list[type];
+			if (def->group == CMD_ASYNC)
+				continue; /* never looked up by token */
+			slot = hash_cmd_token(def->token, def->token_len, def->group, seed);
+			if (cmd_hash[slot])
+				break;
+			cmd_hash[slot] = type + 1;
+		}
+		if (type == CMD_TYPE_MAX)
+			break;
+	}
 
-	sprintf(buf, "%.*s=%u", (int)cmd->def.cmd_len, cmd->def.cmd,
-            global_lw->ctx_mngr.lwan_ctx->mac_params.network_join_mode);
-	buf[buflen] = '\0';
+	if (seed == CMD_HASH_SEED + CMD_HASH_TRIES) {
+		log(LOG_ERR, "no collision free seed for the command lookup");
+		return RETURN_ERROR;
+	}
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	if (seed != CMD_HASH_SEED)
+		log(LOG_INFO, "command lookup seed is %u, update CMD_HASH_SEED", seed);
+	cmd_hash_seed = seed;
 
-	return buf;
+	return RETURN_OK;
 }
 
-char * construct_get_cmd(struct command *cmd)
+struct command_def *lookup_cmd_def(const char *token, size_t token_len,
+		enum cmd_group group)
 {
-	const char *postfix;
-	char *buf, *strptr;
-	size_t buflen, postfixlen;
-
-	postfix = "=?";
-	postfixlen = strlen(postfix);
+	struct command_def *def;
+	uint8_t slot;
 
-	buflen = cmd->def.cmd_len + postfixlen + 1;
+	slot = cmd_hash[hash_cmd_token(token, token_len, group, cmd_hash_seed)];
+	if (!slot)
+		return NULL;
 
-	buf = malloc(buflen);
+	def = &cmd_def_list[slot - 1];
+	if (def->group != group || def->token_len != token_len ||
+			memcmp(def->token, token, token_len))
+		return NULL;
 
-	strptr = buf;
+	return def;
+}
 
-	strncpy(strptr, cmd->def.cmd, cmd->def.cmd_len);
-	strptr += cmd->def.cmd_len;
+/* Whether the parameter of a set is within what the command accepts */
+bool check_cmd_param(struct command_def *def, const char *param, size_t len)
+{
+	struct param_check *check = &def->check;
+	size_t i, digits = 0;
+	long value = 0;
+
+	switch (check->type) {
+		case PARAM_RANGE:
+			/* Decimal, no sign, fits a long for any range in the spec */
+			if (len == 0 || len > 10)
+				return false;
+			for (i = 0; i < len; i++) {
+				if (param[i] < '0' || param[i] > '9')
+					return false;
+				value = value * 10 + param[i] - '0';
+			}
+			return value >= check->min && value <= check->max;
+		case PARAM_HEX_BYTES:
+			/* 0102a0 or 01:02:a0, nothing in between */
+			digits = 2 * check->min;
+			if (len != digits && len != digits + check->min - 1)
+				return false;
+			for (i = 0; i < len; i++) {
+				if (len > digits && i % 3 == 2) {
+					if (param[i] != ':')
+						return false;
+				}
+				else if (!isxdigit((unsigned char)param[i]))
+					return false;
+			}
+			return true;
+		case PARAM_ONE_OF:
+			return len == 1 && param[0] && strchr(check->one_of, param[0]);
+		default:
+			return true;
+	}
+}
 
-	strncpy(strptr, postfix, postfixlen);
-	strptr += postfixlen;
+void set_cmd_deadline(struct command *cmd)
+{
+	cmd->deadline = monotonic_ms() + cmd->timeout;
+}
 
-	*strptr = '\0';
+/*	Commands for the module are written as segments of the uart write.
+ *	The AT strings and their "=?" and "=" forms are string literals of
+ *	cmd_def_list, parameters point at the request, nothing is copied.
+ */
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+int construct_raw_iov(struct command *cmd, struct uart_tx *tx)
+{
+	/* AT, ATZ */
+	set_cmd_deadline(cmd);
 
-	return buf;
+	return uart_tx_add(tx, cmd->def.cmd, cmd->def.cmd_len);
 }
 
-char * construct_set_cmd(struct command *cmd)
+int construct_get_iov(struct command *cmd, struct uart_tx *tx)
 {
-	const char *eqstr;
-	char *buf, *strptr;
-	size_t buflen, eqstrlen;
-
-	eqstr = "=";
-	eqstrlen = strlen(eqstr);
+	/* AT+XXX=? */
+	set_cmd_deadline(cmd);
 
-	buflen = cmd->def.cmd_len + eqstrlen +
-		cmd->param.set.param_len + 1;
+	return uart_tx_add(tx, cmd->def.cmd_get, cmd->def.cmd_get_len);
+}
 
-	buf = malloc(buflen);
+int construct_join_iov(struct command *cmd, struct uart_tx *tx)
+{
+	int ret = RETURN_OK;
+	/* AT+JOIN=[0/1] */
 
-	strptr = buf;
+	ret |= uart_tx_add(tx, cmd->def.cmd_set, cmd->def.cmd_set_len);
+	ret |= uart_tx_add(tx,
+			global_lw->ctx_mngr.lwan_ctx->mac_params.network_join_mode ? "1" : "0", 1);
 
-	strncpy(strptr, cmd->def.cmd, cmd->def.cmd_len);
-	strptr += cmd->def.cmd_len;
+	set_cmd_deadline(cmd);
 
-	strncpy(strptr, eqstr, eqstrlen);
-	strptr += eqstrlen;
+	return ret;
+}
 
-	strncpy(strptr, cmd->param.set.param, cmd->param.set.param_len);
-	strptr += cmd->param.set.param_len;
+int construct_set_iov(struct command *cmd, struct uart_tx *tx)
+{
+	int ret = RETURN_OK;
+	/* AT+XXX=[param] */
 
-	*strptr = '\0';
+	ret |= uart_tx_add(tx, cmd->def.cmd_set, cmd->def.cmd_set_len);
+	ret |= uart_tx_add(tx, cmd->param.set.param, cmd->param.set.param_len);
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	set_cmd_deadline(cmd);
 
-	return buf;
+	return ret;
 }
 
-char * construct_send_cmd(struct command *cmd)
+int construct_send_iov(struct command *cmd, struct uart_tx *tx)
 {
-	char *buf;
-	size_t buflen;
+	const char *cfm;
+	int ret = RETURN_OK;
 	/* AT+SEND=[port]:[confirmation_mode]:[data] */
 
-	buflen = cmd->def.cmd_len /* AT+SEND/B */ +
-		1 /* = */ +
-		cmd->param.send.port_len /* [port] */+
-		3 /* :[cfm]: */ +
-		cmd->param.send.param_len /* [data] */;
+	cfm = global_lw->ctx_mngr.lwan_ctx->mac_params.confirmation_mode ?
+		":1:" : ":0:";
 
-	buf = malloc(buflen + 4);
+	ret |= uart_tx_add(tx, cmd->def.cmd_set, cmd->def.cmd_set_len);
+	ret |= uart_tx_add(tx, cmd->param.send.port, cmd->param.send.port_len);
+	ret |= uart_tx_add(tx, cfm, 3);
+	ret |= uart_tx_add(tx, cmd->param.send.param, cmd->param.send.param_len);
 
-	sprintf(buf, "%.*s=%.*s:%u:%.*s",
-		(int)cmd->def.cmd_len, cmd->def.cmd,
-		(int)cmd->param.send.port_len, cmd->param.send.port,
-		global_lw->ctx_mngr.lwan_ctx->mac_params.confirmation_mode,
-		(int)cmd->param.send.param_len + 1, cmd->param.send.param);
-			   
-	buf[buflen] = '\0';
+	set_cmd_deadline(cmd);
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
-
-	return buf;
+	return ret;
 }
 
-char * construct_context_restore_cmd(struct command *cmd)
+int construct_context_restore_iov(struct command *cmd, struct uart_tx *tx)
 {
-	char *buf;
-	size_t buflen;
-	int type;
+	int type, ret = RETURN_OK;
 	/* AT[+CTX=0:aabbcc] */
 
 	type = cmd->param.internal.context_type;
 
-	buflen = cmd->def.cmd_len /* AT */ +
-			global_lw->ctx_mngr.lwan_ctx->ctx_len[type];
-
-	buf = malloc(buflen + 1);
-	sprintf(buf, "%.*s%.*s",
-			(int)cmd->def.cmd_len, cmd->def.cmd,
-			(int)global_lw->ctx_mngr.lwan_ctx->ctx_len[type],
-			global_lw->ctx_mngr.lwan_ctx->ctx[type]);
-	buf[buflen] = '\0';
+	ret |= uart_tx_add(tx, cmd->def.cmd, cmd->def.cmd_len);
+	ret |= uart_tx_add(tx, global_lw->ctx_mngr.lwan_ctx->ctx[type],
+			global_lw->ctx_mngr.lwan_ctx->ctx_len[type]);
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	set_cmd_deadline(cmd);
 
-	return buf;
+	return ret;
 }
 
 
-/* These commands are not executed in the uart hardware, check local member of command */
+/*	These commands are not executed in the uart hardware, check local member
+ *	of command. They write the reply the module would have given into buf,
+ *	at most size bytes, and return its length.
+ */
 
-char * get_njm_cmd(struct command *cmd)
+size_t put_local_reply(char *buf, size_t size,
+		const char *value, size_t value_len, const char *status)
 {
-	char *result;
-	result = malloc(16);
-	sprintf(result, "%u\r\nOK\r\n",
-            global_lw->ctx_mngr.lwan_ctx->mac_params.network_join_mode);
+	size_t len = 0, n;
+
+	/* [value]\r\n\r\nOK\r\n, the way the module answers */
+	if (value_len) {
+		n = value_len < size ? value_len : size;
+		memcpy(buf, value, n);
+		len += n;
+		n = sizeof(RX_NEWLINE) - 1 < size - len ? sizeof(RX_NEWLINE) - 1 : size - len;
+		memcpy(buf + len, RX_NEWLINE, n);
+		len += n;
+	}
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	n = strlen(status);
+	if (n > size - len)
+		n = size - len;
+	memcpy(buf + len, status, n);
 
-	return result;
+	return len + n;
 }
 
-char * get_cfm_cmd(struct command *cmd)
+size_t get_njm_cmd(struct command *cmd, char *buf, size_t size)
 {
-	char *result;
-	result = malloc(16);
-	sprintf(result, "%u\r\nOK\r\n",
-            global_lw->ctx_mngr.lwan_ctx->mac_params.confirmation_mode);
+	char value;
+
+	value = global_lw->ctx_mngr.lwan_ctx->mac_params.network_join_mode ? '1' : '0';
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	set_cmd_deadline(cmd);
 
-	return result;
+	return put_local_reply(buf, size, &value, 1, response[0]);
 }
 
-char * get_mac_param_cmd(struct command *cmd)
+size_t get_cfm_cmd(struct command *cmd, char *buf, size_t size)
 {
-	char *result;
-	result = malloc(16);
-	sprintf(result, "%u\r\nOK\r\n",
-			global_lw->ctx_mngr.lwan_ctx->mac_params.network_join_mode);
+	char value;
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	value = global_lw->ctx_mngr.lwan_ctx->mac_params.confirmation_mode ? '1' : '0';
 
-	return result;
+	set_cmd_deadline(cmd);
+
+	return put_local_reply(buf, size, &value, 1, response[0]);
 }
 
-char * set_njm_cmd(struct command *cmd)
+size_t set_njm_cmd(struct command *cmd, char *buf, size_t size)
 {
-	char *result;
-	char buf[16];
-	uint8_t code = 0;
-
-	strncpy(buf, cmd->param.set.param, cmd->param.set.param_len);
-	buf[cmd->param.set.param_len] = '\0';
-
-	code = strtol(cmd->param.set.param, NULL, 10);
-	if (code < 0 || code > 1) {
-		result = response[1];
-	}
-	else {
-		global_lw->ctx_mngr.lwan_ctx->mac_params.network_join_mode = code;
-		result = response[0];
-	}
+	/* 0 or 1, see check_cmd_param */
+	global_lw->ctx_mngr.lwan_ctx->mac_params.network_join_mode =
+		cmd->param.set.param[0] - '0';
 
 	log(LOG_INFO, "network join mode = %u",
         global_lw->ctx_mngr.lwan_ctx->mac_params.network_join_mode);
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	set_cmd_deadline(cmd);
 
-	return result;
+	return put_local_reply(buf, size, NULL, 0, response[0]);
 }
 
-char * set_cfm_cmd(struct command *cmd)
+size_t set_cfm_cmd(struct command *cmd, char *buf, size_t size)
 {
-	char *result;
-	char buf[16];
-	uint8_t code = 0;
-
-	strncpy(buf, cmd->param.set.param, cmd->param.set.param_len);
-	buf[cmd->param.set.param_len] = '\0';
-
-
-	code = strtol(cmd->param.set.param, NULL, 10);
-	if (code < 0 || code > 1) {
-        result = response[1];
-	}
-	else {
-		global_lw->ctx_mngr.lwan_ctx->mac_params.confirmation_mode = code;
-        result = response[0];
-	}
+	/* 0 or 1, see check_cmd_param */
+	global_lw->ctx_mngr.lwan_ctx->mac_params.confirmation_mode =
+		cmd->param.set.param[0] - '0';
 
 	log(LOG_INFO, "confirmation mode = %u",
         global_lw->ctx_mngr.lwan_ctx->mac_params.confirmation_mode);
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	set_cmd_deadline(cmd);
 
-    return result;
+	return put_local_reply(buf, size, NULL, 0, response[0]);
 }
 
 
-char * construct_mac_param_cmd(struct command *cmd)
+size_t construct_mac_param_cmd(struct command *cmd, char *buf, size_t size)
 {
-
-	char *result;
 	struct lrwanatd *lw = global_lw;
+	enum mac_pram_type_e param;
 	uint32_t code;
 
-	/* If we have forced this to write to hardware uart, then call the uart code */
-	if (!cmd->def.local_state) {
-		return construct_set_cmd(cmd);
-	}
+	/* When forced to hardware (see set_mac_params), construct_iov is used instead */
 
-	errno = 0;
+	/* Within the range of the spec, see check_cmd_param */
 	code = strtol(cmd->param.set.param, NULL, 10);
 
-	if (errno != 0 ) {
-		log(LOG_ERR, "%s", strerror(errno));
-		result = response[1];
-		return result;
-	}
+	set_cmd_deadline(cmd);
 
 	switch (cmd->def.type) {
 		case CMD_SET_DR:
-			if (code < 0 || code > 7) {
-				result = response[1];
-			}
-			else {
-				lw->ctx_mngr.lwan_ctx->mac_params.dirty |= MAC_PARAM_BIT(MAC_PARAM_DATA_RATE);
-				lw->ctx_mngr.lwan_ctx->mac_params.params[MAC_PARAM_DATA_RATE] = code;
-				result = response[0];
-				log(LOG_INFO, "Data Rate Set: %u", code);
-			}
+			param = MAC_PARAM_DATA_RATE;
 			break;
 		case CMD_SET_TXP:
-			if (code < 0 || code > 5) {
-				result = response[1];
-			}
-			else {
-				lw->ctx_mngr.lwan_ctx->mac_params.dirty |= MAC_PARAM_BIT(MAC_PARAM_TRANSMIT_POWER);
-				lw->ctx_mngr.lwan_ctx->mac_params.params[MAC_PARAM_TRANSMIT_POWER] = code;
-				result = response[0];
-				log(LOG_INFO, "Transmit Power Set: %u", code);
-			}
+			param = MAC_PARAM_TRANSMIT_POWER;
 			break;
 		case CMD_SET_RX1DL:
-			lw->ctx_mngr.lwan_ctx->mac_params.dirty |= MAC_PARAM_BIT(MAC_PARAM_RX1_DELAY);
-			lw->ctx_mngr.lwan_ctx->mac_params.params[MAC_PARAM_RX1_DELAY] = code;
-			result = response[0];
-			log(LOG_INFO, "Rx1 Delay Set: %u", code);
+			param = MAC_PARAM_RX1_DELAY;
 			break;
 		case CMD_SET_RX2DL:
-			lw->ctx_mngr.lwan_ctx->mac_params.dirty |= MAC_PARAM_BIT(MAC_PARAM_RX2_DELAY);
-			lw->ctx_mngr.lwan_ctx->mac_params.params[MAC_PARAM_RX2_DELAY] = code;
-			result = response[0];
-			log(LOG_INFO, "Rx2 Delay Set: %u", code);
+			param = MAC_PARAM_RX2_DELAY;
 			break;
 		case CMD_SET_RX2DR:
-			if (code < 0 || code > 7) {
-				result = response[1];
-			}
-			else {
-				lw->ctx_mngr.lwan_ctx->mac_params.dirty |= MAC_PARAM_BIT(MAC_PARAM_RX2_DATA_RATE);
-				lw->ctx_mngr.lwan_ctx->mac_params.params[MAC_PARAM_RX2_DATA_RATE] = code;
-				result = response[0];
-				log(LOG_INFO, "Rx2 Data Rate Set: %u", code);
-			}
+			param = MAC_PARAM_RX2_DATA_RATE;
 			break;
-        case CMD_SET_ADR:
-            if (code < 0 || code > 1) {
-                result = response[1];
-            }
-            else {
-				lw->ctx_mngr.lwan_ctx->mac_params.dirty |= MAC_PARAM_BIT(MAC_PARAM_ADR);
-				lw->ctx_mngr.lwan_ctx->mac_params.params[MAC_PARAM_ADR] = code;
-				result = response[0];
-				log(LOG_INFO, "ADR Set: %u", code);
-            }
-            break;
+		case CMD_SET_ADR:
+			param = MAC_PARAM_ADR;
+			break;
+		default:
+			return put_local_reply(buf, size, NULL, 0, response[1]);
 	}
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	lw->ctx_mngr.lwan_ctx->mac_params.dirty |= MAC_PARAM_BIT(param);
+	lw->ctx_mngr.lwan_ctx->mac_params.params[param] = code;
+	log(LOG_INFO, "%s set: %u", cmd->def.token, code);
 
-	return result;
+	return put_local_reply(buf, size, NULL, 0, response[0]);
 }
 
-char * construct_delay_cmd(struct command *cmd)
+size_t construct_delay_cmd(struct command *cmd, char *buf, size_t size)
 {
 	/* wait_for_good_timeout */
-	log(LOG_INFO, "Internal Delay  %u", cmd->timeout);
+	log(LOG_INFO, "Internal Delay  %u ms", cmd->timeout);
 
-	cmd->epoc_timeout = get_epoc_timeout(cmd);
+	set_cmd_deadline(cmd);
 
-	return delay_msg;
+	return put_local_reply(buf, size, NULL, 0, delay_msg);
 }
 
 
-char * construct_force_update_cmd(struct command *cmd)
+size_t construct_force_update_cmd(struct command *cmd, char *buf, size_t size)
 {
     log(LOG_INFO, "Force Update");
-    return response[0];
+    return put_local_reply(buf, size, NULL, 0, response[0]);
 }
 
-enum cmd_res_code wait_for_ok(struct command *cmd)
+/* Sets rejected by check_cmd_param, answered without the module */
+size_t construct_param_error_cmd(struct command *cmd, char *buf, size_t size)
+{
+	log(LOG_INFO, "%s rejected: %.*s", cmd->def.token,
+			(int)cmd->param.set.param_len, cmd->param.set.param);
+
+	set_cmd_deadline(cmd);
+
+	return put_local_reply(buf, size, NULL, 0, response[1]);
+}
+
+/*	Parameter cache. Holds the last value read from the firmware, keyed by
+ *	the type of the parameter's get command. Commands served from it become
+ *	local commands, see param_cache_serve. A set drops the entry, the next
+ *	get reads the value back in the firmware's own format.
+ */
+struct param_cache_entry {
+	bool valid;
+	size_t len;
+	char value[PARAM_CACHE_VALUE_MAX];
+};
+
+struct param_cache_entry param_cache[CMD_TYPE_MAX];
+
+/*	Change behind our back, never cached. The network server changes the
+ *	data rate and power (LinkADRReq) and the rx windows (RXParamSetupReq,
+ *	RXTimingSetupReq) with MAC commands.
+ */
+bool is_volatile_param(enum cmd_type type)
+{
+	switch (type) {
+		case CMD_GET_NJS:
+		case CMD_GET_CFS:
+		case CMD_GET_SNR:
+		case CMD_GET_RSSI:
+		case CMD_GET_DR:
+		case CMD_GET_TXP:
+		case CMD_GET_RX1DL:
+		case CMD_GET_RX2DL:
+		case CMD_GET_RX2DR:
+		case CMD_GET_RX2FQ:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Returns the cache entry of the parameter, NULL if it is not cached */
+struct param_cache_entry *param_cache_entry(struct command *cmd)
+{
+	struct command_def *def;
+
+	if (cmd->def.group == CMD_GET)
+		def = &cmd->def;
+	else if (cmd->def.group == CMD_SET) {
+		/* A set shares the entry of the get with the same token */
+		def = lookup_cmd_def(cmd->def.token, cmd->def.token_len, CMD_GET);
+		if (!def)
+			return NULL;
+	}
+	else
+		return NULL;
+
+	if (is_volatile_param(def->type))
+		return NULL;
+
+	return &param_cache[def->type];
+}
+
+size_t construct_cached_get_cmd(struct command *cmd, char *buf, size_t size)
+{
+	struct param_cache_entry *entry = param_cache_entry(cmd);
+
+	return put_local_reply(buf, size, entry->value, entry->len, response[0]);
+}
+
+size_t construct_cached_set_cmd(struct command *cmd, char *buf, size_t size)
+{
+	log(LOG_INFO, "%.*s already set, skipping the write.",
+			(int)cmd->def.cmd_len, cmd->def.cmd);
+	return put_local_reply(buf, size, NULL, 0, response[0]);
+}
+
+/*	Turns a get with a cached value, or a set of the value already cached,
+ *	into a local command. Returns true if it did.
+ */
+bool param_cache_serve(struct command *cmd)
+{
+	struct param_cache_entry *entry;
+
+	if (cmd->no_cache)
+		return false;
+
+	entry = param_cache_entry(cmd);
+	if (!entry || !entry->valid)
+		return false;
+
+	if (cmd->def.group == CMD_GET)
+		cmd->def.construct_cmd = construct_cached_get_cmd;
+	else if (entry->len == cmd->param.set.param_len &&
+			!memcmp(entry->value, cmd->param.set.param, entry->len))
+		cmd->def.construct_cmd = construct_cached_set_cmd;
+	else
+		return false;
+
+	cmd->def.local_state = true;
+	return true;
+}
+
+void param_cache_store(struct param_cache_entry *entry, const char *value, size_t len)
 {
-	size_t resplen;
-	int i;
+	if (len > sizeof(entry->value)) {
+		entry->valid = false;
+		return;
+	}
+	memcpy(entry->value, value, len);
+	entry->len = len;
+	entry->valid = true;
+}
+
+/* Called with every command the firmware has answered */
+void param_cache_update(struct command *cmd)
+{
+	struct param_cache_entry *entry;
+
+	switch (cmd->def.type) {
+		case CMD_JOIN:
+		case CMD_RESET:
+		case CMD_HARD_RESET:
+		case CMD_RESTORE_CONTEXT:
+			/* Session, keys and mac params may all have changed */
+			memset(param_cache, 0, sizeof(param_cache));
+			return;
+		default:
+			break;
+	}
 
-	resplen = sizeof(response)/sizeof(response[0]);
+	entry = param_cache_entry(cmd);
+	if (!entry || cmd->res.status != AT_RES_OK)
+		return;
 
-	for (i = 0; i < resplen; i++) {
-		if (is_buffer_contains(cmd->buf, cmd->buf_len, response[i]))
-			return CMD_RES_OK;
+	if (cmd->def.group == CMD_GET) {
+		if (cmd->res.value_len)
+			param_cache_store(entry, cmd->buf + cmd->res.value_off, cmd->res.value_len);
 	}
+	else
+		/* The set's argument need not be written the way the firmware replies */
+		entry->valid = false;
+}
+
+enum cmd_res_code wait_for_ok(struct command *cmd)
+{
+	/* Any final status line completes the command, errors included */
+	if (cmd->res.status != AT_RES_NONE)
+		return CMD_RES_OK;
 	return CMD_RES_WAITING;
 }
 
 enum cmd_res_code wait_for_timeout(struct command *cmd)
 {
-	time_t now = time(NULL);
-	if (cmd->epoc_timeout <= now) {
+	if (cmd->deadline <= monotonic_ms()) {
 		log(LOG_INFO, "command %p timed out.", cmd);
 		return CMD_RES_TIMEOUT;
 	}
@@ -1023,10 +627,9 @@ enum cmd_res_code wait_for_timeout(struct command *cmd)
 
 enum cmd_res_code wait_for_good_timeout(struct command *cmd)
 {
-	/* sometimes a epoc_timeout is okay :D */
-	time_t now = time(NULL);
-	if (cmd->epoc_timeout <= now) {
-		log(LOG_INFO, "Delay over.", cmd);
+	/* sometimes a timeout is okay :D */
+	if (cmd->deadline <= monotonic_ms()) {
+		log(LOG_INFO, "%s delay over.", cmd->def.token);
 		return CMD_RES_OK;
 	}
 	return CMD_RES_WAITING;
@@ -1042,114 +645,280 @@ enum cmd_res_code wait_for_ok_or_timeout(struct command *cmd)
 
 enum cmd_res_code wait_for_joined_or_timeout(struct command *cmd)
 {
-	if (is_buffer_contains(cmd->buf, cmd->buf_len, JOINED_RESPONSE))
+	if (cmd->res.event == AT_RES_EVT_JOINED)
 		return CMD_RES_OK;
-	else if (is_buffer_contains(cmd->buf, cmd->buf_len, JOIN_FAILED_RESPONSE))
-		return CMD_RES_TIMEOUT; // notify failure as epoc_timeout.
+	else if (cmd->res.event == AT_RES_EVT_JOIN_FAILED)
+		return CMD_RES_TIMEOUT; // notify failure as timeout.
 
 	return wait_for_timeout(cmd);
 }
 
-/* This structure will help in parsing, +EVT:[port]:[data]\r\n */
+#define MORE_TX_LINE "Network Server is asking for an uplink transmission"
+
+/*	State of the async scanner. Complete rx lines are consumed from the
+ *	uart ring as they are scanned, only a partial line stays behind.
+ *	A payload line is held until the RX_n line that follows it.
+ */
 struct {
-	size_t start;
-	size_t end;
-	bool found;
+	size_t scan_off; /* bytes of the partial line already looked at */
+	bool pending;
+	char port[8];
+	size_t port_len;
+	char payload[ASYNC_LINE_MAX];
+	size_t payload_len;
+	/* Line the scanner could not decode, retried with the regex */
+	char fallback[ASYNC_LINE_MAX];
+	size_t fallback_len;
 } async_rx_context;
 
+/* Scanner primitives, each advances *p past what it accepted */
+bool scan_lit(const char **p, const char *end, const char *lit, size_t len)
+{
+	if ((size_t)(end - *p) < len || memcmp(*p, lit, len))
+		return false;
+	*p += len;
+	return true;
+}
 
-void remove_buf_substr(struct lrwanatd *lw, size_t so, size_t eo)
+bool scan_span(const char **p, const char *end, bool hex, bool sign)
 {
-	char _buf[8192];
-	char *buf = lw->uart.buf;
-	size_t buf_len = lw->uart.buf_len;
-	lw->uart.buf[lw->uart.buf_len] = '\0';
+	const char *s = *p;
+	char c;
 
-	strncpy(_buf, buf, so);
-	_buf[so] = '\0';
-	strcat(_buf, buf + eo);
+	if (sign && s < end && *s == '-')
+		s++;
 
-	strcpy(lw->uart.buf, _buf);
-	lw->uart.buf_len = buf_len - (eo - so);
+	while (s < end) {
+		c = *s;
+		if (!((c >= '0' && c <= '9') ||
+				(hex && ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')))))
+			break;
+		s++;
+	}
+
+	if (s == *p || (sign && s == *p + 1 && **p == '-'))
+		return false;
+	*p = s;
+	return true;
 }
 
+#define SCAN_LIT(p, end, lit) scan_lit(p, end, lit, sizeof(lit) - 1)
 
-void async_recv(struct lrwanatd *lw, char *buf, size_t buflen)
+/* +EVT:[port]:[len]:[payload] */
+bool scan_evt_payload(const char *line, size_t len, struct async_evt *evt)
 {
-	int ret;
-	regmatch_t match[lw->regex.n_recv_grps];
-	// use this buff as msg or error buff depenending on situtation.
-	char msgbuf[255] = { '\0' };
-    // log(LOG_INFO, "%.*s", buflen, buf);
-	ret = regexec(&lw->regex.recv, buf, lw->regex.n_recv_grps, match, 0);
+	const char *p = line, *end = line + len, *s;
+
+	if (!SCAN_LIT(&p, end, EVT_PREFIX))
+		return false;
+
+	s = p;
+	if (!scan_span(&p, end, false, false))
+		return false;
+	evt->port = s;
+	evt->port_len = p - s;
+
+	if (!SCAN_LIT(&p, end, ":") || !scan_span(&p, end, false, false) ||
+			!SCAN_LIT(&p, end, ":"))
+		return false;
+
+	s = p;
+	if (!scan_span(&p, end, true, false) || p != end)
+		return false;
+	evt->payload = s;
+	evt->payload_len = p - s;
+	return true;
+}
 
-	if (!ret) {
-		// got match
-		// message format is port,payload,fcntdown,event,rssi,snr
+/* +EVT:RX_[n], DR [n], RSSI [n], SNR [n] */
+bool scan_evt_rx(const char *line, size_t len, struct async_evt *evt)
+{
+	const char *p = line, *end = line + len, *s;
+
+	if (!SCAN_LIT(&p, end, EVT_PREFIX))
+		return false;
+
+	s = p;
+	if (!SCAN_LIT(&p, end, "RX_") || !scan_span(&p, end, false, false))
+		return false;
+	evt->window = s;
+	evt->window_len = p - s;
+
+	if (!SCAN_LIT(&p, end, ", DR ") || !scan_span(&p, end, false, false) ||
+			!SCAN_LIT(&p, end, ", RSSI "))
+		return false;
+
+	s = p;
+	if (!scan_span(&p, end, false, true))
+		return false;
+	evt->rssi = s;
+	evt->rssi_len = p - s;
+
+	if (!SCAN_LIT(&p, end, ", SNR "))
+		return false;
+
+	s = p;
+	if (!scan_span(&p, end, false, true) || p != end)
+		return false;
+	evt->snr = s;
+	evt->snr_len = p - s;
+	return true;
+}
 
-		for (int i=1; i < lw->regex.n_recv_grps; i++) {
-			int len = match[i].rm_eo - match[i].rm_so;
-			strncat(msgbuf, buf + match[i].rm_so, len);
-			if (i != lw->regex.n_recv_grps - 1)
-				strcat(msgbuf, ",");
-		}
-		lw->push.cb->recv(lw, msgbuf, strlen(msgbuf));
-		remove_buf_substr(lw, match[0].rm_so, match[0].rm_eo);
+void dispatch_async_evt(struct lrwanatd *lw, struct async_evt *evt)
+{
+	struct command_def *def = get_cmd_def(evt->type);
 
-		context_manager_event(CMD_ASYNC_RECV, NULL);
-	}
-	else if (ret != REG_NOMATCH) {
-		// error, because its neither 0 nor REG_NOMATCH
-		regerror(ret, &lw->regex.recv, msgbuf, sizeof(msgbuf));
-		log(LOG_ERR, "Recv regex match failed: %s\n", msgbuf);
+	if (def && def->group == CMD_ASYNC && def->async_cmd)
+		def->async_cmd(lw, evt);
+}
+
+//static const char *recv_pattern = "\\+EVT:([0-9]+):([a-f0-9]+)..#FCNTDOWN:([0-9]+)#..\\+EVT:[A-Z0-9]+, RSSI (-?[0-9]+), SNR (-?[0-9]+)..";
+
+static const char *recv_pattern = "\\+EVT:([0-9]+):[0-9]+:([a-f0-9]+)..\\+EVT:(RX_[0-9]), DR [0-9], RSSI (-?[0-9]+), SNR (-?[0-9]+)..";
+int init_regex(struct lrwanatd *lw)
+{
+	if (regcomp(&lw->regex.recv, recv_pattern, REG_EXTENDED)) {
+		log(LOG_ERR, "cannot compile regex: recv_pattern.");
+		return RETURN_ERROR;
 	}
+	lw->regex.n_recv_grps = 6; // 5 match groups + 1
+	return RETURN_OK;
 }
 
-#if 0 // old receive
-void async_recv(struct lrwanatd *lw, char *buf, size_t buflen)
+/* Regex fallback for a payload/RX line pair the scanner could not decode */
+bool async_recv_regex(struct lrwanatd *lw, const char *line, size_t len)
 {
-	const char *start_with, *should_not_follow_with, *end_with;
-	size_t len;
-	start_with = "+EVT:";
-	should_not_follow_with = "RX";
-	end_with = "\r\n";
-
-	/*	If not found, check for +EVT:
-	*	If found, check for RX right after +EVT:. If RX present, set to not found
-	*	If found, check for "\r\n" to register a positive hit.
-	*/
-
-	if (!_async_rx_context.found) {
-		if(!cmp_last_few_chars(buf, buflen, start_with)) {
-			_async_rx_context.found = true;
-			_async_rx_context.start = buflen;
+	struct async_evt evt = { .type = CMD_ASYNC_RECV };
+	char buf[2 * ASYNC_LINE_MAX + 8];
+	char msgbuf[2 * ASYNC_LINE_MAX + 8] = { '\0' };
+	regmatch_t match[lw->regex.n_recv_grps];
+	int ret;
+
+	snprintf(buf, sizeof(buf), "%.*s\r\n%.*s\r\n",
+			(int)async_rx_context.fallback_len, async_rx_context.fallback,
+			(int)len, line);
+
+	ret = regexec(&lw->regex.recv, buf, lw->regex.n_recv_grps, match, 0);
+	if (ret) {
+		if (ret != REG_NOMATCH) {
+			// error, because its neither 0 nor REG_NOMATCH
+			regerror(ret, &lw->regex.recv, msgbuf, sizeof(msgbuf));
+			log(LOG_ERR, "Recv regex match failed: %s\n", msgbuf);
 		}
+		return false;
 	}
-	else {
-		len = _async_rx_context.start + strlen(should_not_follow_with);
-		if(buflen == len &&
-				!cmp_last_few_chars(buf, buflen, should_not_follow_with)){
-			_async_rx_context.found = false;
-		}
-		else if (!cmp_last_few_chars(buf, buflen, end_with)) {
-			_async_rx_context.end = buflen - strlen(end_with);
 
-			/* Yay, a successful match, push it out */
-			lw->push.cb->recv(lw, buf + _async_rx_context.start,
-					_async_rx_context.end - _async_rx_context.start);
-			_async_rx_context.found = false;
+	// message format is port,payload,event,rssi,snr
+	for (int i=1; i < lw->regex.n_recv_grps; i++) {
+		int len = match[i].rm_eo - match[i].rm_so;
+		strncat(msgbuf, buf + match[i].rm_so, len);
+		if (i != lw->regex.n_recv_grps - 1)
+			strcat(msgbuf, ",");
+	}
+
+	evt.msg = msgbuf;
+	dispatch_async_evt(lw, &evt);
+	return true;
+}
+
+void scan_async_line(struct lrwanatd *lw, const char *line, size_t len)
+{
+	struct async_evt evt = { .type = CMD_TYPE_MAX };
+	bool fallback = async_rx_context.fallback_len > 0;
+
+	async_rx_context.fallback_len = 0;
+
+	if (len > sizeof(EVT_PREFIX) - 1 &&
+			!memcmp(line, EVT_PREFIX, sizeof(EVT_PREFIX) - 1)) {
+		switch (line[sizeof(EVT_PREFIX) - 1]) {
+			case 'R':
+				if (async_rx_context.pending && scan_evt_rx(line, len, &evt)) {
+					evt.type = CMD_ASYNC_RECV;
+					evt.port = async_rx_context.port;
+					evt.port_len = async_rx_context.port_len;
+					evt.payload = async_rx_context.payload;
+					evt.payload_len = async_rx_context.payload_len;
+				}
+				else if (fallback)
+					async_recv_regex(lw, line, len);
+				break;
+			case 'J':
+				switch (classify_at_line(line, len)) {
+					case AT_RES_EVT_JOINED:
+						evt.type = CMD_ASYNC_JOINED;
+						break;
+					case AT_RES_EVT_JOIN_FAILED:
+						evt.type = CMD_ASYNC_JOIN_FAILED;
+						break;
+					default:
+						break;
+				}
+				break;
+			default:
+				/* Keep the raw line in case the RX_n line does not decode */
+				if (len <= sizeof(async_rx_context.fallback)) {
+					memcpy(async_rx_context.fallback, line, len);
+					async_rx_context.fallback_len = len;
+				}
+
+				if (scan_evt_payload(line, len, &evt) &&
+						evt.port_len <= sizeof(async_rx_context.port) &&
+						evt.payload_len <= sizeof(async_rx_context.payload)) {
+					/* Hold it until the RX_n line, the line itself is consumed */
+					memcpy(async_rx_context.port, evt.port, evt.port_len);
+					async_rx_context.port_len = evt.port_len;
+					memcpy(async_rx_context.payload, evt.payload, evt.payload_len);
+					async_rx_context.payload_len = evt.payload_len;
+					async_rx_context.pending = true;
+					return;
+				}
+				break;
 		}
 	}
+	else if (len == sizeof(MORE_TX_LINE) - 1 && !memcmp(line, MORE_TX_LINE, len))
+		evt.type = CMD_ASYNC_MORE_TX;
+
+	/* A payload line is only valid right before its RX_n line */
+	async_rx_context.pending = false;
+
+	if (evt.type != CMD_TYPE_MAX)
+		dispatch_async_evt(lw, &evt);
 }
-#endif
 
-void async_has_more_tx(struct lrwanatd *lw, char *buf, size_t buflen)
+void async_recv(struct lrwanatd *lw, struct async_evt *evt)
 {
-	char  *str = "Network Server is asking for an uplink transmission\n\r";
-	if (is_buffer_contains(buf, buflen, str)) {
-		lw->push.cb->more_tx(lw, NULL, 0); /* Yay, a successful match, push it out */
-		// clean it?
+	char msgbuf[ASYNC_LINE_MAX + 64];
+	char *msg = evt->msg;
+	size_t msglen;
+
+	if (!msg) {
+		// message format is port,payload,event,rssi,snr
+		snprintf(msgbuf, sizeof(msgbuf), "%.*s,%.*s,%.*s,%.*s,%.*s",
+				(int)evt->port_len, evt->port,
+				(int)evt->payload_len, evt->payload,
+				(int)evt->window_len, evt->window,
+				(int)evt->rssi_len, evt->rssi,
+				(int)evt->snr_len, evt->snr);
+		msg = msgbuf;
 	}
+
+	msglen = strlen(msg);
+	lw->push.cb->recv(lw, msg, msglen);
+
+	context_manager_event(CMD_ASYNC_RECV, NULL);
+}
+
+void async_has_more_tx(struct lrwanatd *lw, struct async_evt *evt)
+{
+	lw->push.cb->more_tx(lw, NULL, 0); /* Yay, a successful match, push it out */
+}
+
+void async_join_evt(struct lrwanatd *lw, struct async_evt *evt)
+{
+	/* The executing join command sees the same line through its tokenizer */
+	log(LOG_INFO, "join event: %s",
+			evt->type == CMD_ASYNC_JOINED ? "joined" : "join failed");
 }
 
 struct cmd_queue_head *init_cmd_queue()
@@ -1159,80 +928,225 @@ struct cmd_queue_head *init_cmd_queue()
 	return head;
 }
 
+struct command *make_type_cmd(enum cmd_type type,
+		union command_param *param,
+		unsigned int timeout_ms)
+{
+	struct command *cmd;
+
+	/* Zeroed, NULL with errno ENOMEM once the pool runs dry */
+	cmd = pool_alloc(&global_lw->pool.cmd);
+	if (!cmd)
+		return NULL;
+
+	cmd->def = cmd_def_list[type];
+	cmd->buf_len = 0;
+	cmd->state = CMD_NEW;
+	if (param)
+		cmd->param = *param;
+	if (timeout_ms)
+		cmd->timeout = timeout_ms;
+	else
+		cmd->timeout = DEFAULT_TIMEOUT;
+
+	return cmd;
+}
+
+/*	Command for a token of the HTTP API, NULL if there is none. A set whose
+ *	parameter fails check_cmd_param is answered locally with AT_PARAM_ERROR.
+ */
 struct command *make_cmd(char *token, size_t token_len,
 		union command_param *param,
-		time_t timeout_in_sec,
+		unsigned int timeout_ms,
 		enum cmd_group group)
 {
-	struct command *cmd = NULL;
 	struct command_def *def;
-	size_t cmd_def_list_size;
-	int i;
-
-	cmd_def_list_size = sizeof(cmd_def_list)/sizeof(cmd_def_list[0]);
-
-	for (i = 0; i < cmd_def_list_size; i++) {
-		def = &cmd_def_list[i];
-		if (group == def->group &&
-				token_len == def->token_len &&
-				!strncmp(token, def->token, token_len)) {
-			cmd = calloc(1, sizeof(struct command));
-			cmd->def = *def;
-			cmd->buf_len = 0;
-			cmd->state = CMD_NEW;
-			if (param)
-				cmd->param = *param;
-#if 0
-			if (timeout_in_sec)
-				cmd->epoc_timeout = time(NULL) + timeout_in_sec;
-			else /* use default epoc_timeout */
-				cmd->epoc_timeout = time(NULL) + DEFAULT_TIMEOUT;
-#endif
-			if (timeout_in_sec)
-				cmd->timeout = timeout_in_sec;
-			else
-				cmd->timeout = DEFAULT_TIMEOUT;
+	struct command *cmd;
 
-			break;
-		}
+	def = lookup_cmd_def(token, token_len, group);
+	if (!def)
+		return NULL;
+
+	cmd = make_type_cmd(def->type, param, timeout_ms);
+	if (!cmd)
+		return NULL;
+
+	if (group == CMD_SET && param &&
+			!check_cmd_param(def, param->set.param, param->set.param_len)) {
+		cmd->def.construct_cmd = construct_param_error_cmd;
+		cmd->def.construct_iov = NULL;
+		cmd->def.local_state = true;
 	}
+
 	return cmd;
 }
 
-void set_active_cmd_uart_buf(struct cmd_queue_head *cmdq_head, char *buf, size_t len)
+enum at_res_type classify_at_line(const char *line, size_t len)
 {
-	struct command *cmd;
+	struct at_line_def *def;
+	size_t n, i;
+
+	if (len > sizeof(EVT_PREFIX) - 1 &&
+			!memcmp(line, EVT_PREFIX, sizeof(EVT_PREFIX) - 1)) {
+		line += sizeof(EVT_PREFIX) - 1;
+		len -= sizeof(EVT_PREFIX) - 1;
+		def = at_evt_lines;
+		n = sizeof(at_evt_lines)/sizeof(at_evt_lines[0]);
+		for (i = 0; i < n; i++)
+			if (def[i].len == len && !memcmp(line, def[i].str, len))
+				return def[i].type;
+		return AT_RES_EVT;
+	}
 
-	cmd = STAILQ_FIRST(cmdq_head);
+	/* Status lines all start with 'O' or 'A' */
+	if (line[0] == 'O' || line[0] == 'A') {
+		def = at_status_lines;
+		n = sizeof(at_status_lines)/sizeof(at_status_lines[0]);
+		for (i = 0; i < n; i++)
+			if (def[i].len == len && !memcmp(line, def[i].str, len))
+				return def[i].type;
+	}
+
+	return AT_RES_VALUE;
+}
 
-	while(cmd && cmd->state != CMD_EXECUTING)
-		cmd = STAILQ_NEXT(cmd, entries);
+void tokenize_cmd_buf(struct command *cmd)
+{
+	struct command_result *res = &cmd->res;
+	enum at_res_type type;
+	size_t i, len;
+	char c;
+
+	/*	Only the bytes appended since the last call are looked at.
+	 *	AT_SLAVE uses \r\n and \n\r interchangeably, so any run of
+	 *	either ends a line and empty lines are skipped.
+	 */
+	for (i = res->scan_off; i < cmd->buf_len; i++) {
+		c = cmd->buf[i];
+		if (c != '\r' && c != '\n')
+			continue;
 
-	if (cmd) {
-		assert(cmd->state == CMD_EXECUTING);
-		memcpy(cmd->buf + cmd->buf_len, buf, len);
-		cmd->buf_len += len;
+		len = i - res->line_off;
+		if (len) {
+			type = classify_at_line(cmd->buf + res->line_off, len);
+			switch (type) {
+				case AT_RES_VALUE:
+					if (!res->value_len) {
+						res->value_off = res->line_off;
+						res->value_len = len;
+					}
+					break;
+				case AT_RES_EVT:
+					/* Downlinks and other async events, see run_async_cmd */
+					break;
+				case AT_RES_EVT_JOINED:
+				case AT_RES_EVT_JOIN_FAILED:
+					res->event = type;
+					break;
+				default:
+					res->status = type;
+					break;
+			}
+		}
+		res->line_off = i + 1;
 	}
+	res->scan_off = cmd->buf_len;
 }
 
-void run_async_cmd(struct lrwanatd *lw, char *buf, size_t buflen)
+void set_cmd_uart_buf(struct command *cmd, char *buf, size_t len)
 {
-	struct command *cmd = NULL;
-	struct command_def *def;
-	size_t cmd_def_list_size;
-	int i;
+	assert(cmd->state == CMD_EXECUTING);
+	/* Keep room for the terminating NUL */
+	if (len > sizeof(cmd->buf) - 1 - cmd->buf_len) {
+		log(LOG_INFO, "command buffer full, truncating response.");
+		len = sizeof(cmd->buf) - 1 - cmd->buf_len;
+	}
+	memcpy(cmd->buf + cmd->buf_len, buf, len);
+	cmd->buf_len += len;
+	cmd->buf[cmd->buf_len] = '\0';
+	tokenize_cmd_buf(cmd);
+}
+
+/* Runs a local command, its reply is written straight into cmd->buf */
+void run_local_cmd(struct command *cmd)
+{
+	size_t len;
+
+	cmd->state = CMD_EXECUTING;
+	len = cmd->def.construct_cmd(cmd, cmd->buf + cmd->buf_len,
+			sizeof(cmd->buf) - 1 - cmd->buf_len);
+	cmd->buf_len += len;
+	cmd->buf[cmd->buf_len] = '\0';
+	tokenize_cmd_buf(cmd);
+}
 
-	cmd_def_list_size = sizeof(cmd_def_list)/sizeof(cmd_def_list[0]);
+void run_async_cmd(struct lrwanatd *lw)
+{
+	struct ringbuf *rx = &lw->uart.rx;
+	size_t i, len, line_off = 0;
+	char *buf, c;
 
-	for (i = 0; i < cmd_def_list_size; i++) {
-		def = &cmd_def_list[i];
-		if (def->group != CMD_ASYNC)
+	/* Single pass over the new bytes, every complete line is scanned once */
+	buf = ringbuf_linearize(rx);
+	len = ringbuf_len(rx);
+
+	for (i = async_rx_context.scan_off; i < len; i++) {
+		c = buf[i];
+		if (c != '\r' && c != '\n')
 			continue;
 
-		if (def->async_cmd)
-			def->async_cmd(lw, buf, buflen);
+		if (i > line_off)
+			scan_async_line(lw, buf + line_off, i - line_off);
+		line_off = i + 1;
 	}
 
+	/* Scanned lines are done with, a line too long to be an event is dropped */
+	if (len - line_off > ASYNC_LINE_MAX)
+		line_off = len;
+
+	ringbuf_consume(rx, line_off);
+	async_rx_context.scan_off = len - line_off;
+}
+
+struct command_def *get_cmd_def(enum cmd_type type)
+{
+	if (type < 0 || type >= CMD_TYPE_MAX)
+		return NULL;
+	return &cmd_def_list[type];
+}
+
+/* The command completes on the module's final response line */
+bool cmd_waits_for_response(struct command *cmd)
+{
+	return cmd->def.process_cmd == wait_for_ok_or_timeout;
+}
+
+/*	Why an executed command failed, as reported in the HTTP replies: the
+ *	module's error line, TIMEOUT, JOIN_FAILED or NO_RESPONSE when it was
+ *	never answered. NULL if it succeeded.
+ */
+const char *get_cmd_error(struct command *cmd)
+{
+	struct at_line_def *def = at_status_lines;
+	size_t i, n = sizeof(at_status_lines)/sizeof(at_status_lines[0]);
+
+	if (cmd->res.event == AT_RES_EVT_JOIN_FAILED)
+		return "JOIN_FAILED";
+	if (cmd->res.timed_out)
+		return "TIMEOUT";
+
+	switch (cmd->res.status) {
+		case AT_RES_OK:
+			return NULL;
+		case AT_RES_NONE:
+			/* Resets and delays complete on time, sends and gets on OK */
+			return cmd_waits_for_response(cmd) ? "NO_RESPONSE" : NULL;
+		default:
+			for (i = 0; i < n; i++)
+				if (def[i].type == cmd->res.status)
+					return def[i].str;
+			return "AT_ERROR";
+	}
 }
 
 void free_cmd_queue(struct cmd_queue_head *cmdq_head)
@@ -1242,16 +1156,11 @@ void free_cmd_queue(struct cmd_queue_head *cmdq_head)
 
 	while (cmd != NULL) {
 		cmd_next = STAILQ_NEXT(cmd, entries);
-		free(cmd);
+		if (cmd->deadline_ev)
+			event_free(cmd->deadline_ev);
+		pool_free(&global_lw->pool.cmd, cmd);
 		cmd = cmd_next;
 	}
 
 	free(cmdq_head);
 }
-
-void clear_uart_buf(size_t *buflen)
-{
-	*buflen = 0;
-	async_rx_context.found = false;
-	async_rx_context.start = async_rx_context.end = 0;
-}
@@ -99,7 +99,7 @@ void set_mac_params() {
 	struct http_client *client;
 	struct lrwanatd *lw;
 	struct command *cmd;
-	char *token;
+	enum cmd_type type;
 	union command_param param;
 	log(LOG_INFO, "Setting mac params on firmware!\n");
 
@@ -114,32 +114,32 @@ void set_mac_params() {
 		if (check) {
 			switch (param_type) {
                 case MAC_PARAM_ADR:
-                    token = TOKEN_AT_ADR;
+                    type = CMD_SET_ADR;
 					memset(params_str[param_type], 0, 255);
 					sprintf(params_str[param_type], "%u", lwan_ctx.mac_params.params[param_type]);
 					break;
 				case MAC_PARAM_DATA_RATE:
-					token = TOKEN_AT_DR;
+					type = CMD_SET_DR;
 					memset(params_str[param_type], 0, 255);
 					sprintf(params_str[param_type], "%u", lwan_ctx.mac_params.params[param_type]);
 					break;
 				case MAC_PARAM_TRANSMIT_POWER:
-					token = TOKEN_AT_TXP;
+					type = CMD_SET_TXP;
 					memset(params_str[param_type], 0, 255);
 					sprintf(params_str[param_type], "%u", lwan_ctx.mac_params.params[param_type]);
 					break;
 				case MAC_PARAM_RX1_DELAY:
-					token = TOKEN_AT_RX1DL;
+					type = CMD_SET_RX1DL;
 					memset(params_str[param_type], 0, 255);
 					sprintf(params_str[param_type], "%u", lwan_ctx.mac_params.params[param_type]);
 					break;
 				case MAC_PARAM_RX2_DELAY:
-					token = TOKEN_AT_RX2DL;
+					type = CMD_SET_RX2DL;
 					memset(params_str[param_type], 0, 255);
 					sprintf(params_str[param_type], "%u", lwan_ctx.mac_params.params[param_type]);
 					break;
 				case MAC_PARAM_RX2_DATA_RATE:
-					token = TOKEN_AT_RX2DR;
+					type = CMD_SET_RX2DR;
 					memset(params_str[param_type], 0, 255);
 					sprintf(params_str[param_type], "%u", lwan_ctx.mac_params.params[param_type]);
 					break;
@@ -150,8 +150,9 @@ void set_mac_params() {
 			param.set.param_len = strlen(params_str[param_type]);
 
 			/* Force the command to execute in hardware */
-			cmd = make_cmd(token, strlen(token),
-						   &param, 0, CMD_SET);
+			cmd = make_type_cmd(type, &param, 0);
+			if (!cmd)
+				continue; /* still dirty, written on the next try */
 			cmd->def.local_state = false;
 			STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
 			lwan_ctx.mac_params.dirty &= ~(MAC_PARAM_BIT(param_type));
@@ -164,7 +165,7 @@ void set_mac_params() {
 		STAILQ_INSERT_TAIL(lw->http.http_clientq_head, client, entries);
 	}
 	else {
-		free_http_client(lw, client);
+		destroy_http_client(lw, client);
 		this->client = NULL;
 		log(LOG_ERR, "cannot accept local client");
 	}
@@ -183,19 +184,19 @@ void generate_ctx()
 	client->local = true;
 	this->client = client;
 
-	cmd = make_cmd(TOKEN_AT_DELAY, sizeof(TOKEN_AT_DELAY) - 1,
-				   NULL, 5, CMD_INTERNAL);
+	cmd = make_type_cmd(CMD_DELAY, NULL, 5000);
 
-	STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
+	if (cmd)
+		STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
 
 	/* Initiate a acquire context command */
-	cmd = make_cmd(TOKEN_AT_CTX_ACQ, sizeof(TOKEN_AT_CTX_ACQ) - 1,
-				   NULL, 0, CMD_INTERNAL);
+	cmd = make_type_cmd(CMD_ACQUIRE_CONTEXT, NULL, 0);
 
 	if (!cmd) {
-		free_http_client(lw, client);
+		destroy_http_client(lw, client);
 		this->client = NULL;
 		log(LOG_ERR, "cannot accept local client");
+		return;
 	}
 
 	STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
@@ -206,7 +207,7 @@ void generate_ctx()
 		STAILQ_INSERT_TAIL(lw->http.http_clientq_head, client, entries);
 	}
 	else {
-		free_http_client(lw, client);
+		destroy_http_client(lw, client);
 		this->client = NULL;
 		log(LOG_ERR, "cannot accept local client");
 	}
@@ -234,33 +235,32 @@ void restore_firmware_context()
 		if (lwan_ctx.ctx_len[type] == 0) {
 			continue;
 		}
-		cmd = make_cmd(TOKEN_AT_CTX_RES, sizeof(TOKEN_AT_CTX_RES) - 1,
-					   &cmd_param, 0, CMD_INTERNAL);
+		cmd = make_type_cmd(CMD_RESTORE_CONTEXT, &cmd_param, 0);
 		if (cmd) {
 			STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
 			log(LOG_INFO, "added restore command for context type %d", type);
 		}
 
-		cmd = make_cmd(TOKEN_AT_DELAY, sizeof(TOKEN_AT_DELAY) - 1,
-					   NULL, 2, CMD_INTERNAL);
+		cmd = make_type_cmd(CMD_DELAY, NULL, 2000);
 
-		STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
+		if (cmd)
+			STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
 
 	}
 
-	/* Always trigger restore first */
-	STAILQ_INSERT_HEAD(lw->http.http_clientq_head, client, entries);
-
-	if (STAILQ_EMPTY(client->cmdq_head)) {
-		free_http_client(lw, client);
-		this->client = NULL;
-		log(LOG_ERR, "cannot accept local client");
-	}
-	else {
+	if  (!STAILQ_EMPTY(client->cmdq_head)) {
 		log(LOG_INFO, "accepted local client");
 		client->state = HTTP_CLIENT_REQUEST_COMPLETE;
+		/*	Queued like any other, pick_lane serves SCHED_LANE_RESTORE
+		 *	before every other lane.
+		 */
+		STAILQ_INSERT_TAIL(lw->http.http_clientq_head, client, entries);
+	}
+	else {
+		destroy_http_client(lw, client);
+		this->client = NULL;
+		log(LOG_ERR, "cannot accept local client");
 	}
-
 }
 
 
@@ -343,7 +343,7 @@ bool check_if_client_error()
 		if (cmd == NULL) break;
 		if (cmd->state == CMD_NEW || cmd->def.type == CMD_DELAY)
 			continue;
-		if (!is_buffer_contains(cmd->buf, cmd->buf_len, "OK")) {
+		if (cmd->res.status != AT_RES_OK) {
 			return true;
 		}
 	}
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include <assert.h>
 #include "http.h"
 #include "command.h"
@@ -13,9 +15,25 @@
 #include "logger.h"
 #include "picohttpparser.h"
 #include "jsmn.h"
+#include "scheduler.h"
+#include "rtt.h"
+#include "json_writer.h"
 
-#define HTTP_ERROR_500 "HTTP/1.1 500 Internal Server Error\nContent-Type: application/json\n\n{\"status\":\"ERROR\"}"
-#define HTTP_ERROR_401 "HTTP/1.1 401 Not Found\nContent-Type: application/json\n\n{\"status\":\"ERROR\"}"
+/* Status line and body, see set_http_error */
+#define HTTP_ERROR_400 "400 Bad Request", "{\"status\":\"ERROR\"}"
+#define HTTP_ERROR_500 "500 Internal Server Error", "{\"status\":\"ERROR\"}"
+#define HTTP_ERROR_503 "503 Service Unavailable", "{\"status\":\"BUSY\"}"
+#define HTTP_ERROR_404 "404 Not Found", "{\"status\":\"ERROR\"}"
+#define HTTP_ERROR_413 "413 Payload Too Large", "{\"status\":\"ERROR\"}"
+
+#define HTTP_HEADER_MAX 256
+#define HTTP_OUT_MIN 4096
+#define HTTP_OUT_MAX (64 * 1024) /* replies held for a slow reader */
+#define HTTP_WRITE_TIMEOUT_MS 10000 /* a reader taking nothing for this long is dropped */
+#define HTTP_BODY_MAX (64 * 1024) /* bodies past client->buf are read into the heap */
+#define JSON_TOKENS_MIN 128
+
+void on_write_http(evutil_socket_t fd, short what, void *arg);
 
 
 struct http_client_queue_head *init_http_client_queue()
@@ -26,82 +44,206 @@ struct http_client_queue_head *init_http_client_queue()
 }
 
 
-char * get_http_action_string(enum http_action action)
+struct http_route;
+
+typedef int (*http_add_cmds_fp)(struct http_client *client,
+		const struct http_route *route, jsmntok_t *t, int n);
+
+struct http_route {
+	enum http_action action;
+	const char *name;
+	const char *method;
+	size_t method_len;
+	const char *path;
+	size_t path_len;
+	enum http_body body;
+	http_add_cmds_fp add_cmds; /* t is NULL for HTTP_BODY_NONE */
+	enum cmd_type cmd;
+	unsigned int timeout_ms;
+};
+
+int add_route_cmd(struct http_client *client, const struct http_route *route,
+		jsmntok_t *t, int n);
+int add_get_config_cmds(struct http_client *client, const struct http_route *route,
+		jsmntok_t *t, int n);
+int add_set_config_cmds(struct http_client *client, const struct http_route *route,
+		jsmntok_t *t, int n);
+int add_send_cmd(struct http_client *client, const struct http_route *route,
+		jsmntok_t *t, int n);
+
+#define HTTP_ROUTE_DEF(_action, _name, _method, _path, _body, _add_cmds, \
+		_cmd, _timeout_ms) \
+	[_action] = { \
+		.action = _action, \
+		.name = _name, \
+		.method = _method, \
+		.method_len = sizeof(_method) - 1, \
+		.path = _path, \
+		.path_len = sizeof(_path) - 1, \
+		.body = _body, \
+		.add_cmds = _add_cmds, \
+		.cmd = _cmd, \
+		.timeout_ms = _timeout_ms, \
+	},
+
+struct http_route http_route_list[HTTP_ACTION_MAX] = {
+	[HTTP_UNDEFINED] = { .action = HTTP_UNDEFINED, .name = "Undefined" },
+	HTTP_ROUTE_SPEC(HTTP_ROUTE_DEF)
+};
+
+/*	Route lookup, the same scheme as the command tokens in command.c: the
+ *	(method, path) pairs hash into distinct slots, so a request is matched
+ *	with one hash and one compare however many routes there are.
+ */
+#define HTTP_ROUTE_HASH_SIZE 64
+#define HTTP_ROUTE_HASH_SEED 3
+#define HTTP_ROUTE_HASH_TRIES 100000
+
+uint8_t http_route_hash[HTTP_ROUTE_HASH_SIZE]; /* action, 0 when empty */
+uint32_t http_route_hash_seed;
+
+/* FNV-1a over the method, then the path */
+uint32_t hash_http_route(const char *method, size_t method_len,
+		const char *path, size_t path_len, uint32_t seed)
 {
-	switch(action) {
-		case HTTP_UNDEFINED:
-			return "Undefined";
-		case HTTP_RESET:
-			return "Reset";
-		case HTTP_HARD_RESET:
-			return "Hard Reset";
-		case HTTP_STATUS:
-			return "Status";
-		case HTTP_JOIN:
-			return "Join";
-		case HTTP_SET_CONFIG:
-			return "Set Config";
-		case HTTP_GET_CONFIG:
-			return "Get Config";
-		case HTTP_SEND_DATA:
-			return "Send Data";
-		case HTTP_SENDB_DATA:
-			return "Send Binary Data";
-        case HTTP_FORCE_UPDATE:
-            return "Force Update";
-		default:
-			return "Unknown Action";
+	uint32_t h = 2166136261u ^ seed;
+	size_t i;
+
+	for (i = 0; i < method_len; i++) {
+		h ^= (unsigned char)method[i];
+		h *= 16777619u;
+	}
+	h ^= ' ';
+	h *= 16777619u;
+	for (i = 0; i < path_len; i++) {
+		h ^= (unsigned char)path[i];
+		h *= 16777619u;
 	}
-}
 
+	return h & (HTTP_ROUTE_HASH_SIZE - 1);
+}
 
-enum http_action get_action_from_http_request(struct http_client *client)
+int init_http_routes()
 {
-	if (strncmp("GET", client->request.method , client->request.method_len) == 0
-			&& strncmp("/reset", client->request.path, client->request.path_len) == 0)
-		return HTTP_RESET;
+	struct http_route *route;
+	uint32_t seed, slot;
+	enum http_action action;
+
+	for (seed = HTTP_ROUTE_HASH_SEED; seed < HTTP_ROUTE_HASH_SEED + HTTP_ROUTE_HASH_TRIES; seed++) {
+		memset(http_route_hash, 0, sizeof(http_route_hash));
+		for (action = HTTP_UNDEFINED + 1; action < HTTP_ACTION_MAX; action++) {
+			route = &http_route_list[action];
+			slot = hash_http_route(route->method, route->method_len,
+					route->path, route->path_len, seed);
+			if (http_route_hash[slot])
+				break;
+			http_route_hash[slot] = action;
+		}
+		if (action == HTTP_ACTION_MAX)
+			break;
+	}
 
-	if (strncmp("GET", client->request.method , client->request.method_len) == 0
-		&& strncmp("/hard_reset", client->request.path, client->request.path_len) == 0)
-		return HTTP_HARD_RESET;
+	if (seed == HTTP_ROUTE_HASH_SEED + HTTP_ROUTE_HASH_TRIES) {
+		log(LOG_ERR, "no collision free seed for the route lookup");
+		return RETURN_ERROR;
+	}
 
-	if (strncmp("GET", client->request.method , client->request.method_len) == 0
-			&& strncmp("/status", client->request.path, client->request.path_len) == 0)
-		return HTTP_STATUS;
+	if (seed != HTTP_ROUTE_HASH_SEED)
+		log(LOG_INFO, "route lookup seed is %u, update HTTP_ROUTE_HASH_SEED", seed);
+	http_route_hash_seed = seed;
 
-	if (strncmp("GET", client->request.method , client->request.method_len) == 0
-			&& strncmp("/join", client->request.path, client->request.path_len) == 0)
-		return HTTP_JOIN;
+	return RETURN_OK;
+}
 
-	if (strncmp("GET", client->request.method , client->request.method_len) == 0
-			&& strncmp("/force_update", client->request.path, client->request.path_len) == 0)
-		return HTTP_FORCE_UPDATE;
+char * get_http_action_string(enum http_action action)
+{
+	if (action >= HTTP_ACTION_MAX)
+		return "Unknown Action";
+	return (char *)http_route_list[action].name;
+}
 
-	if (strncmp("POST", client->request.method , client->request.method_len) == 0
-			&& strncmp("/config/get", client->request.path, client->request.path_len) == 0)
-		return HTTP_GET_CONFIG;
+/* The route the request's method and path are exactly, HTTP_UNDEFINED if none */
+enum http_action get_action_from_http_request(struct http_client *client)
+{
+	struct http_route *route;
+	uint8_t slot;
+
+	slot = http_route_hash[hash_http_route(client->request.method,
+			client->request.method_len, client->request.path,
+			client->request.path_len, http_route_hash_seed)];
+	if (!slot)
+		return HTTP_UNDEFINED;
+
+	route = &http_route_list[slot];
+	if (route->method_len != client->request.method_len ||
+			route->path_len != client->request.path_len ||
+			memcmp(route->method, client->request.method, route->method_len) ||
+			memcmp(route->path, client->request.path, route->path_len))
+		return HTTP_UNDEFINED;
+
+	return route->action;
+}
 
-	if (strncmp("POST", client->request.method , client->request.method_len) == 0
-			&& strncmp("/config/set", client->request.path, client->request.path_len) == 0)
-		return HTTP_SET_CONFIG;
 
-	if (strncmp("POST", client->request.method , client->request.method_len) == 0
-			&& strncmp("/send", client->request.path, client->request.path_len) == 0)
-		return HTTP_SEND_DATA;
+/*	Content-Length must be plain decimal digits. A length past
+ *	HTTP_BODY_MAX, however many digits it takes, is stored as
+ *	HTTP_BODY_MAX + 1 so that it is refused with a 413 and never wraps
+ *	header_len + content_len.
+ */
+int parse_content_len(const char *value, size_t value_len, size_t *content_len)
+{
+	char tmp[16], *end;
+	unsigned long n;
+	size_t i;
 
-	if (strncmp("POST", client->request.method , client->request.method_len) == 0
-			&& strncmp("/sendb", client->request.path, client->request.path_len) == 0)
-		return HTTP_SENDB_DATA;
+	if (!value_len)
+		return RETURN_ERROR;
+	for (i = 0; i < value_len; i++)
+		if (value[i] < '0' || value[i] > '9')
+			return RETURN_ERROR;
 
-	return HTTP_UNDEFINED;
+	if (value_len >= sizeof(tmp)) {
+		*content_len = HTTP_BODY_MAX + 1;
+		return RETURN_OK;
+	}
+
+	memcpy(tmp, value, value_len);
+	tmp[value_len] = '\0';
+	errno = 0;
+	n = strtoul(tmp, &end, 10);
+	if (*end != '\0')
+		return RETURN_ERROR;
+	*content_len = (errno == ERANGE || n > HTTP_BODY_MAX) ? HTTP_BODY_MAX + 1 : n;
+	return RETURN_OK;
 }
 
+/* True if the comma separated list value holds directive, case aside */
+bool has_http_directive(const char *value, size_t value_len, const char *directive)
+{
+	size_t dlen = strlen(directive), start, end, i = 0;
+
+	while (i < value_len) {
+		while (i < value_len && (value[i] == ' ' || value[i] == '\t'))
+			i++;
+		start = i;
+		while (i < value_len && value[i] != ',')
+			i++;
+		end = i++;
+		while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+			end--;
+		if (end - start == dlen && !strncasecmp(directive, value + start, dlen))
+			return true;
+	}
+
+	return false;
+}
 
 int parse_http_buf(struct http_client *client, size_t len)
 {
-	int pret, minor_version;
+	int pret, minor_version, connection = -1;
 	struct phr_header headers[48];
 	size_t num_headers, prevbuflen;
+	bool bad_len = false;
 	int i;
 
 	prevbuflen = client->buf_len;
@@ -114,21 +256,41 @@ int parse_http_buf(struct http_client *client, size_t len)
 			&minor_version, headers, &num_headers, prevbuflen);
 
 	for (i = 0; i != num_headers; ++i) {
-		if (strncmp("Content-Length", headers[i].name, headers[i].name_len) == 0) {
-			char tmp[16];
-			strncpy(tmp, headers[i].value, headers[i].value_len);
-			tmp[headers[i].value_len] = '\0';
-			client->request.content_len = atoi(tmp);
-		}
+		if (headers[i].name_len == sizeof("Content-Length") - 1 &&
+				!strncasecmp("Content-Length", headers[i].name, headers[i].name_len) &&
+				parse_content_len(headers[i].value, headers[i].value_len,
+					&client->request.content_len) < 0)
+			bad_len = true;
 
 		if (strncmp("Content-Type", headers[i].name, headers[i].name_len) == 0 &&
 				strncmp("application/json", headers[i].value, headers[i].value_len) == 0) {
 			client->is_json = true;
 		}
+
+		if (headers[i].name_len == sizeof("Cache-Control") - 1 &&
+				!strncasecmp("Cache-Control", headers[i].name, headers[i].name_len) &&
+				has_http_directive(headers[i].value, headers[i].value_len, "no-cache"))
+			client->no_cache = true;
+
+		/* HTTP/1.1 keeps the connection unless told otherwise, 1.0 the reverse */
+		if (headers[i].name_len == sizeof("Connection") - 1 &&
+				!strncasecmp("Connection", headers[i].name, headers[i].name_len)) {
+			if (headers[i].value_len == sizeof("close") - 1 &&
+					!strncasecmp("close", headers[i].value, headers[i].value_len))
+				connection = 0;
+			else if (headers[i].value_len == sizeof("keep-alive") - 1 &&
+					!strncasecmp("keep-alive", headers[i].value, headers[i].value_len))
+				connection = 1;
+		}
 	}
 
 	if (pret > 0) { /* request complete */
+		if (bad_len) {
+			log(LOG_INFO, "malformed Content-Length.");
+			return RETURN_ERROR;
+		}
 		client->request.header_len = pret;
+		client->keep_alive = connection < 0 ? minor_version >= 1 : connection;
 		client->action = get_action_from_http_request(client);
 		log(LOG_INFO, "%.*s %.*s Json?%s Content-Length: %d Action:%s",
 				client->request.method_len, client->request.method,
@@ -144,239 +306,466 @@ int parse_http_buf(struct http_client *client, size_t len)
 	return 1; /* more to go */
 }
 
-int add_cmd(struct http_client *client)
+/* A route's one command, GET /reset, /status and the like */
+int add_route_cmd(struct http_client *client, const struct http_route *route,
+		jsmntok_t *t, int n)
 {
-	struct command *cmd = NULL;
+	struct command *cmd;
 
-	switch(client->action) {
-		case HTTP_RESET:
-			cmd = make_cmd(TOKEN_AT_RESET, sizeof(TOKEN_AT_RESET) - 1,
-					NULL, 10, CMD_ACTION);
-			break;
-		case HTTP_HARD_RESET:
-			cmd = make_cmd(TOKEN_AT_HARD_RESET, sizeof(TOKEN_AT_HARD_RESET) - 1,
-						   NULL, 10, CMD_ACTION);
-			break;
-		case HTTP_STATUS:
-			cmd = make_cmd(TOKEN_AT, sizeof(TOKEN_AT) - 1,
-					NULL, 0, CMD_ACTION);
-			break;
-		case HTTP_JOIN:
-	/* Timeout of 1 minute */
-			cmd = make_cmd(TOKEN_AT_JOIN , sizeof(TOKEN_AT_JOIN) - 1,
-					NULL, 60,CMD_ACTION);
-			break;
-        case HTTP_FORCE_UPDATE:
-            cmd = make_cmd(TOKEN_AT_FORCE_UPDATE, sizeof (TOKEN_AT_FORCE_UPDATE) - 1,
-                    NULL, 1, CMD_INTERNAL);
+	cmd = make_type_cmd(route->cmd, NULL, route->timeout_ms);
+	if (!cmd)
+		return RETURN_ERROR;
+
+	STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
+	return RETURN_OK;
+}
+
+/* 	The request should be of the type
+*	[
+*	"command1",
+*	"command2",
+*	....
+*	]
+*/
+int add_get_config_cmds(struct http_client *client, const struct http_route *route,
+		jsmntok_t *t, int n)
+{
+	struct command *cmd;
+	jsmntok_t *tok;
+	int i;
+
+	if (t[0].type != JSMN_ARRAY)
+		return RETURN_ERROR;
+
+	/* More commands than the pool holds would never get through */
+	if (t[0].size > CMD_POOL_SIZE) {
+		errno = E2BIG;
+		return RETURN_ERROR;
 	}
-	if (cmd)
-		STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
-	else
+
+	// First pass check if all tokens are string
+	for (i =1; i < t[0].size + 1; i++) {
+		tok = &t[i];
+		if (tok->type != JSMN_STRING)
+			return RETURN_ERROR;
+	}
+
+
+	for (i =1; i < t[0].size + 1; i++) {
+		tok = &t[i];
+		char *tkstr = client->request.content + tok->start;
+		size_t tklen = tok->end - tok->start;
+		cmd = make_cmd(tkstr, tklen, NULL, route->timeout_ms, CMD_GET);
+		if (cmd) {
+			cmd->no_cache = client->no_cache;
+			STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
+		}
+		else
+			return RETURN_ERROR;
+	}
+
+	return RETURN_OK;
+}
+
+/* The request should be of the type
+*	{
+*		"command1": "param1",
+*		"command2": "param2",
+*		....
+*	}
+*/
+int add_set_config_cmds(struct http_client *client, const struct http_route *route,
+		jsmntok_t *t, int n)
+{
+	struct command *cmd;
+	jsmntok_t *tok1, *tok2;
+	int i;
+
+	if (t[0].type != JSMN_OBJECT)
 		return RETURN_ERROR;
 
+	if (t[0].size > CMD_POOL_SIZE) {
+		errno = E2BIG;
+		return RETURN_ERROR;
+	}
+
+	for (i =1; i < t[0].size * 2 + 1; i += 2) {
+		union command_param cmd_param;
+		tok1 = &t[i];
+		tok2 = &t[i + 1];
+
+		char *tkstr = client->request.content + tok1->start;
+		size_t tklen = tok1->end - tok1->start;
+
+		char *param = client->request.content + tok2->start;
+		size_t paramlen = tok2->end - tok2->start;
+		cmd_param.set.param = param;
+		cmd_param.set.param_len = paramlen;
+		cmd = make_cmd(tkstr, tklen, &cmd_param, route->timeout_ms, CMD_SET);
+		if (cmd) {
+			cmd->no_cache = client->no_cache;
+			STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
+		}
+		else
+			return RETURN_ERROR;
+	}
+
 	return RETURN_OK;
 }
 
+/*	The request should be of the type
+*	{
+*		"data": "thisisdata",
+*		"port": 21,
+*	}
+*/
+int add_send_cmd(struct http_client *client, const struct http_route *route,
+		jsmntok_t *t, int n)
+{
+	struct command *cmd;
+	char *data = NULL, *port = NULL;
+	size_t data_len = 0, port_len = 0;
+	jsmntok_t *tok1, *tok2;
+	int i;
+
+	if (t[0].type != JSMN_OBJECT)
+		return RETURN_ERROR;
+
+	for (i =1; i < t[0].size * 2 + 1; i += 2) {
+		tok1 = &t[i];
+		tok2 = &t[i + 1];
+
+		char *tkstr = client->request.content + tok1->start;
+		size_t tklen = tok1->end - tok1->start;
+
+		char *param = client->request.content + tok2->start;
+		size_t paramlen = tok2->end - tok2->start;
+
+		if (!strncmp(tkstr, "data", tklen)) {
+			data = param;
+			data_len = paramlen;
+		}
+		else if (!strncmp(tkstr, "port", tklen)) {
+			port = param;
+			port_len = paramlen;
+		}
+	}
+
+	if (!data || !port)
+		return RETURN_ERROR;
+
+	union command_param cmd_param;
+	cmd_param.send.param = data;
+	cmd_param.send.param_len = data_len;
+	cmd_param.send.port = port;
+	cmd_param.send.port_len = port_len;
+
+	cmd = make_type_cmd(route->cmd, &cmd_param, route->timeout_ms);
+	if (!cmd)
+		return RETURN_ERROR;
+
+	STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
+	return RETURN_OK;
+}
+
+/*	Token storage shared by every request, a body is parsed and turned
+ *	into commands in one go and its tokens are not needed after that. It
+ *	grows to the largest body seen; a token takes at least two bytes of
+ *	the body, so HTTP_BODY_MAX bounds it.
+ */
+jsmntok_t *json_tokens;
+unsigned int json_tokens_cap;
+
+/* Parses the JSON body and hands it to the route of the request */
 int parse_json_content_add_cmd(struct http_client *client)
 {
-	struct command *cmd = NULL;
-	char *data, *port;
-	size_t data_len, port_len;
+	const struct http_route *route = &http_route_list[client->action];
 	jsmn_parser p;
-	jsmntok_t t[128];
-	jsmntok_t *tok, *tok1, *tok2;
+	jsmntok_t *t;
+	unsigned int cap;
+	int ret;
+
 	jsmn_init(&p);
-	memset(t, 0, sizeof(t));
-	int i, ret = jsmn_parse(&p, client->request.content, client->request.content_len, t, 128);
+	for (;;) {
+		/* With no tokens at all jsmn would only count them */
+		if (json_tokens_cap) {
+			ret = jsmn_parse(&p, client->request.content, client->request.content_len,
+					json_tokens, json_tokens_cap);
+			if (ret != JSMN_ERROR_NOMEM)
+				break;
+		}
+
+		/* The parser picks up where it stopped once there is more room */
+		cap = json_tokens_cap ? json_tokens_cap * 2 : JSON_TOKENS_MIN;
+		t = realloc(json_tokens, cap * sizeof(jsmntok_t));
+		if (!t)
+			return RETURN_ERROR;
+		json_tokens = t;
+		json_tokens_cap = cap;
+	}
 	if (ret < 0)
 		return ret;
+	t = json_tokens;
+	/* An empty body has no value at all */
+	if (ret == 0 || !route->add_cmds)
+		return RETURN_ERROR;
 
-	switch(client->action) {
-		case HTTP_GET_CONFIG:
-			/* 	The request should be of the type
-			*	[
-			*	"command1",
-			*	"command2",
-			*	....
-			*	]
-			*/
-			if (t[0].type != JSMN_ARRAY)
-				return RETURN_ERROR;
-
-			// First pass check if all tokens are string
-			for (i =1; i < t[0].size + 1; i++) {
-				tok = &t[i];
-				if (tok->type != JSMN_STRING)
-					return RETURN_ERROR;
-			}
+	return route->add_cmds(client, route, t, ret);
+}
 
 
-			for (i =1; i < t[0].size + 1; i++) {
-				tok = &t[i];
-				char *tkstr = client->request.content + tok->start;
-				size_t tklen = tok->end - tok->start;
-				/* 1 minute timeout */
-				cmd = make_cmd(tkstr, tklen, NULL, 60, CMD_GET);
-				if (cmd)
-					STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
-				else
-					return RETURN_ERROR;
-			}
+void set_http_error(struct http_client *client, const char *status, const char *body)
+{
+	client->state = HTTP_CLIENT_ERROR;
+	client->error_status = status;
+	client->error_body = body;
+}
 
+/* Reads no more requests, the fd is closed once they are all answered */
+void stop_http_conn(struct http_conn *conn)
+{
+	if (conn->closed)
+		return;
+	event_del(conn->read_event);
+	conn->closed = true;
+}
 
-			break;
-		case HTTP_SET_CONFIG:
-			/* The request should be of the type
-			*	{
-			*		"command1": "param1",
-			*		"command2": "param2",
-			*		....
-			*	}
-			*/
-			if (t[0].type != JSMN_OBJECT)
-				return RETURN_ERROR;
-
-			for (i =1; i < t[0].size * 2 + 1; i += 2) {
-				union command_param cmd_param;
-				tok1 = &t[i];
-				tok2 = &t[i + 1];
-
-				char *tkstr = client->request.content + tok1->start;
-				size_t tklen = tok1->end - tok1->start;
-
-				char *param = client->request.content + tok2->start;
-				size_t paramlen = tok2->end - tok2->start;
-				cmd_param.set.param = param;
-				cmd_param.set.param_len = paramlen;
-				/* 1 minute timeout */
-				cmd = make_cmd(tkstr, tklen, &cmd_param, 60, CMD_SET);
-				if (cmd)
-					STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
-				else
-					return RETURN_ERROR;
-			}
+void free_http_conn(struct http_conn *conn)
+{
+	event_del(conn->read_event);
+	event_free(conn->read_event);
+	event_del(conn->write_event);
+	event_free(conn->write_event);
+	close(conn->fd);
+	free(conn->out);
+	free(conn);
+}
 
-			break;
-		case HTTP_SEND_DATA:
-		case HTTP_SENDB_DATA:
-			/*	The request should be of the type
-			*	{
-			*		"data": "thisisdata",
-			*		"port": 21,
-			*	}
-			*/
-			data_len = port_len = 0;
-			data = port = NULL;
-
-			if (t[0].type != JSMN_OBJECT)
-				return RETURN_ERROR;
-
-			for (i =1; i < t[0].size * 2 + 1; i += 2) {
-				tok1 = &t[i];
-				tok2 = &t[i + 1];
-
-				char *tkstr = client->request.content + tok1->start;
-				size_t tklen = tok1->end - tok1->start;
-
-				char *param = client->request.content + tok2->start;
-				size_t paramlen = tok2->end - tok2->start;
-
-				if (!strncmp(tkstr, "data", tklen)) {
-					data = param;
-                    data_len = paramlen;
-				}
-				else if (!strncmp(tkstr, "port", tklen)) {
-					port = param;
-                    port_len = paramlen;
-				}
-			}
+/* The peer went away, so did everything it still waits for */
+void close_http_conn(struct lrwanatd *lw, struct http_conn *conn)
+{
+	struct http_client *client = conn->reading;
 
-			if (data && port) {
-				union command_param cmd_param;
-				cmd_param.send.param = data;
-				cmd_param.send.param_len = data_len;
-				cmd_param.send.port = port;
-				cmd_param.send.port_len = port_len;
-
-				if (client->action == HTTP_SEND_DATA)
-					cmd = make_cmd(TOKEN_AT_SEND, sizeof(TOKEN_AT_SEND) - 1,
-                                   &cmd_param, 0, CMD_SEND);
-				else
-					cmd = make_cmd(TOKEN_AT_SENDB, sizeof(TOKEN_AT_SENDB) - 1,
-                                   &cmd_param, 0, CMD_SEND);
-
-				if (cmd)
-					STAILQ_INSERT_TAIL(client->cmdq_head, cmd, entries);
-				else
-					return RETURN_ERROR;
-			} else {
-				return RETURN_ERROR;
-			}
+	stop_http_conn(conn);
+	/*	Half read, nothing of it runs yet and its buffer may be large. It is
+	 *	not queued, so a scheduler pass cannot be holding on to it.
+	 */
+	if (client) {
+		conn->reading = NULL;
+		client->conn = NULL;
+		conn->requests--;
+		destroy_http_client(lw, client);
+	}
+	/* Nobody left to read the pending replies */
+	event_del(conn->write_event);
+	conn->out_len = conn->out_off = 0;
+
+	if (!conn->requests) {
+		free_http_conn(conn);
+		return;
+	}
+
+	/*	Nothing more of them goes to the uart. A command the uart is busy
+	 *	with still runs to its end, the module answers it anyway, see
+	 *	schedule_cmds.
+	 */
+	STAILQ_FOREACH(client, lw->http.http_clientq_head, entries) {
+		if (client->conn != conn)
+			continue;
+		client->state = HTTP_CLIENT_DISCONNECTED;
+		if (client != lw->sched.uart_client)
+			sched_release_client(lw, client);
+	}
+}
+
+/*	The next request of the connection. It is only queued for the
+ *	scheduler once it has been read, see queue_http_request.
+ */
+struct http_client *new_conn_request(struct lrwanatd *lw, struct http_conn *conn)
+{
+	struct http_client *client;
+
+	client = create_http_client(lw, conn->fd);
+	client->local = false;
+	client->conn = conn;
+	client->seq = conn->received++;
+	conn->requests++;
+	conn->reading = client;
+	return client;
+}
+
+/* The request is complete or failed, the scheduler takes it from here */
+void queue_http_request(struct lrwanatd *lw, struct http_conn *conn,
+		struct http_client *client)
+{
+	conn->reading = NULL;
+	STAILQ_INSERT_TAIL(lw->http.http_clientq_head, client, entries);
+}
+
+/* Checks the request once its body is in, returns false if it failed */
+bool finish_http_request(struct http_client *client)
+{
+	const struct http_route *route = &http_route_list[client->action];
+	int ret = RETURN_OK;
+
+	client->state = HTTP_CLIENT_REQUEST_COMPLETE;
+	client->request.content = (char *)client->data + client->request.header_len;
+
+	errno = 0;
+	if (route->body == HTTP_BODY_JSON) {
+		if (!client->request.content_len || !client->is_json) {
+			log(LOG_INFO, "%s expects a JSON body.", route->name);
+			set_http_error(client, HTTP_ERROR_500);
+			return false;
+		}
+		ret = parse_json_content_add_cmd(client);
+		if (ret < 0)
+			log(LOG_INFO, "JSON parse error.");
+	}
+	else if (route->add_cmds) {
+		ret = route->add_cmds(client, route, NULL, 0);
+		if (ret < 0)
+			log(LOG_INFO, "add command error");
 	}
+
+	if (ret < 0) {
+		/* Out of commands, see CMD_POOL_SIZE */
+		if (errno == ENOMEM)
+			set_http_error(client, HTTP_ERROR_503);
+		else if (errno == E2BIG)
+			set_http_error(client, HTTP_ERROR_413);
+		else
+			set_http_error(client, HTTP_ERROR_500);
+		return false;
+	}
+
+	return true;
+}
+
+/*	Moves a request whose body does not fit client->buf to the heap. The
+ *	headers stay where they were parsed, the rest is read into data.
+ */
+int grow_http_request(struct http_client *client, size_t len)
+{
+	unsigned char *data;
+
+	if (client->request.content_len > HTTP_BODY_MAX)
+		return RETURN_ERROR;
+
+	data = malloc(len);
+	if (!data)
+		return RETURN_ERROR;
+	memcpy(data, client->buf, client->buf_len);
+	client->data = data;
+	client->data_size = len;
 	return RETURN_OK;
 }
 
+/*	Parses the len bytes just read into the request being received. Bytes
+ *	past the end of a complete request start the next one, so pipelined
+ *	requests are queued one after the other. Returns true if any request
+ *	became ready for the scheduler.
+ */
+bool on_http_data(struct lrwanatd *lw, struct http_conn *conn, size_t len)
+{
+	struct http_client *client = conn->reading, *next;
+	size_t request_len, excess;
+	bool ready = false;
+	int ret;
+
+	while (client) {
+		if (!client->request.header_len) {
+			ret = parse_http_buf(client, len);
+			client->buf_len += len;
+		}
+		else {
+			ret = 0; /* headers already in, waiting for the body */
+			client->buf_len += len;
+		}
+
+		log(LOG_INFO, "%.*s", client->buf_len, client->data);
+
+		/* Malformed or too large, the stream cannot be followed any more */
+		if (ret == -1)
+			set_http_error(client, HTTP_ERROR_400);
+		else if (ret == 1 && client->buf_len == sizeof(client->buf))
+			set_http_error(client, HTTP_ERROR_413);
+		else if (ret == 1)
+			return ready; /* more to go */
+		else if (client->action == HTTP_UNDEFINED) /* Nothing to do here */
+			set_http_error(client, HTTP_ERROR_404);
+		else {
+			request_len = client->request.header_len + client->request.content_len;
+			if (request_len > client->data_size &&
+					grow_http_request(client, request_len) < 0) {
+				log(LOG_INFO, "request body of %zu bytes refused.",
+						client->request.content_len);
+				set_http_error(client, HTTP_ERROR_413);
+			}
+			else if (client->buf_len < request_len)
+				return ready; /* body still coming */
+			else if (finish_http_request(client) && client->keep_alive) {
+				ready = true;
+				queue_http_request(lw, conn, client);
+
+				excess = client->buf_len - request_len;
+				if (!excess)
+					return ready;
+
+				/* Pipelined, the next request is already here */
+				client->buf_len = request_len;
+				next = new_conn_request(lw, conn);
+				/* Only a request read into buf is followed by more bytes */
+				memcpy(next->data, client->data + request_len, excess);
+				client = next;
+				len = excess;
+				continue;
+			}
+		}
+
+		/* Failed, or the last request of the connection */
+		if (client->state == HTTP_CLIENT_ERROR)
+			client->keep_alive = false;
+		queue_http_request(lw, conn, client);
+		stop_http_conn(conn);
+		return true;
+	}
+
+	return ready;
+}
 
 void on_read_http(evutil_socket_t fd, short what, void *arg)
 {
-	struct http_client *client = (struct http_client *)arg;
+	struct http_conn *conn = (struct http_conn *)arg;
+	struct lrwanatd *lw = global_lw;
+	struct http_client *client;
 	ssize_t len;
 
-	if (client->state == HTTP_CLIENT_DISCONNECTED)
+	if (conn->closed)
 		return;
 
-	len = read(fd, (void *)&client->buf[client->buf_len],
-			sizeof(client->buf) - client->buf_len);
+	client = conn->reading ? conn->reading : new_conn_request(lw, conn);
+
+	len = read(fd, (void *)&client->data[client->buf_len],
+			client->data_size - client->buf_len);
 
 	if (len == 0) {
 		log(LOG_INFO, "http client disconnected.\n");
-		client->state = HTTP_CLIENT_DISCONNECTED;
+		close_http_conn(lw, conn);
 		return;
 	}
 	else if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
 		log(LOG_INFO, "socket failure, disconnecting http client: %s",
 				strerror(errno));
-		client->state = HTTP_CLIENT_DISCONNECTED;
+		close_http_conn(lw, conn);
 		return;
 	}
 
-	int ret = parse_http_buf(client, len);
-	client->buf_len += len;
-
-	log(LOG_INFO, "%.*s", client->buf_len, client->buf);
-
-	if (ret == 0) {
-		if (client->action == HTTP_UNDEFINED) { /* Nothing to do here */
-			strcpy(client->error_resp, HTTP_ERROR_401);
-			client->state = HTTP_CLIENT_ERROR;
-			return;
-		}
-		if (client->request.content_len &&
-				client->buf_len >= (client->request.header_len + client->request.content_len)) {
-			client->state = HTTP_CLIENT_REQUEST_COMPLETE;
-			client->request.content = client->buf + client->request.header_len;
-
-			if (client->is_json && parse_json_content_add_cmd(client) < 0) {
-				log(LOG_INFO, "JSON parse error.");
-				strcpy(client->error_resp, HTTP_ERROR_500);
-				client->state = HTTP_CLIENT_ERROR;
-			}
-		}
-		if (!client->request.content_len && !client->is_json) {
-			client->state = HTTP_CLIENT_REQUEST_COMPLETE;
-
-			if(add_cmd(client) < 0) {
-				log(LOG_INFO, "add command error");
-				strcpy(client->error_resp, HTTP_ERROR_500);
-				client->state = HTTP_CLIENT_ERROR;
-			}
-		}
-
-	}
-	else if (ret == -1) {
-		client->state = HTTP_CLIENT_ERROR;
-	}
+	/* Local commands can complete right away, no need to wait for the timer */
+	if (on_http_data(lw, conn, len))
+		schedule_cmds(lw);
 }
 
 struct http_client * create_http_client(struct lrwanatd *lw, int fd)
@@ -384,22 +773,31 @@ struct http_client * create_http_client(struct lrwanatd *lw, int fd)
 	struct http_client *client;
 	client = malloc(sizeof(struct http_client));
 	client->fd = fd;
+	client->conn = NULL;
+	client->seq = 0;
+	client->keep_alive = false;
 	client->cmdq_head = init_cmd_queue();
 	client->is_json = client->timed_out =  false;
+	client->data = client->buf;
+	client->data_size = sizeof(client->buf);
 	client->buf_len = client->request.path_len =
 	client->request.header_len = client->request.method_len =
 	client->request.content_len = 0;
+	client->action = HTTP_UNDEFINED;
 	client->state = HTTP_CLIENT_ACTIVE;
 	client->local = client->restore_context = false;
-	strcpy(client->error_resp, HTTP_ERROR_500);
-	memset(client->buf, 0, sizeof(client->buf));
+	client->sched_queued = false;
+	client->no_cache = false;
+	client->error_status = NULL;
+	client->error_body = NULL;
+	/* Only buf[0, buf_len) is ever read, no need to clear it */
 	return client;
 }
 
 void on_accept_http(evutil_socket_t fd, short what, void *arg)
 {
 	struct lrwanatd *lw = (struct lrwanatd *)arg;
-	struct http_client *client;
+	struct http_conn *conn;
 	int client_fd;
 	struct sockaddr_in client_addr;
 
@@ -414,80 +812,307 @@ void on_accept_http(evutil_socket_t fd, short what, void *arg)
 	if (set_nonblock_sock(client_fd) < 0)
 		log(LOG_INFO, "http sock non blocking not set.");
 
-	client = create_http_client(lw, client_fd);
+	conn = calloc(1, sizeof(struct http_conn));
+	conn->fd = client_fd;
 
-	/* This is not local client */
-	client->local = false;
+	/* Requests are created as their bytes come in, see on_read_http */
+	conn->read_event = event_new(lw->event.base, client_fd, EV_READ|EV_PERSIST,
+								   on_read_http, (void *)conn);
+	event_priority_set(conn->read_event, 1);
+	/* Added only while replies are pending, see http_client_reply */
+	conn->write_event = event_new(lw->event.base, client_fd, EV_WRITE|EV_PERSIST,
+								   on_write_http, (void *)conn);
+	event_priority_set(conn->write_event, 1);
 
-	client->read_event = event_new(lw->event.base, client_fd, EV_READ|EV_PERSIST,
-								   on_read_http, (void *)client);
-	event_priority_set(client->read_event, 1);
+	event_add(conn->read_event, NULL);
 
+	log(LOG_INFO, "accepted http connection from %s with fd %d\n",
+			inet_ntoa(client_addr.sin_addr), conn->fd);
+}
 
-	STAILQ_INSERT_TAIL(lw->http.http_clientq_head, client, entries);
+/*	Upper bound of what reply_cmds_json writes for cmd: the key and the
+ *	value, both escaped, and room for the status and error fields.
+ */
+#define CMD_REPLY_JSON_FIELDS 96
 
-	event_add(client->read_event, NULL);
+size_t reply_cmds_json_max(struct http_client *client)
+{
+	struct command *cmd;
+	size_t len = sizeof("{\n\n}\n") - 1;
 
-	log(LOG_INFO, "accepted http connection from %s with fd %d\n",
-			inet_ntoa(client_addr.sin_addr), client->fd);
+	STAILQ_FOREACH(cmd, client->cmdq_head, entries)
+		len += JSON_STRING_MAX(cmd->def.token_len) +
+			JSON_STRING_MAX(cmd->res.value_len) + CMD_REPLY_JSON_FIELDS;
+	return len;
 }
 
-char *reply_get_cmds(struct http_client *client)
+/* A get's value, a number if the spec says it is one, see command_spec.h */
+void reply_cmd_value(struct json_writer *w, struct command *cmd)
 {
-	char *buf = calloc(1, 8196);;
-	char *sptr = buf;
-	strcpy(sptr, "[\n");
-	sptr+= 2;
+	const char *value = cmd->buf + cmd->res.value_off;
+	size_t len = cmd->res.value_len;
+	char *end;
+	long num;
+
+	if (cmd->def.check.type == PARAM_RANGE) {
+		/* value is followed by its line ending, strtol stops there */
+		errno = 0;
+		num = strtol(value, &end, 10);
+		if (end == value + len && !errno) {
+			json_int(w, num);
+			return;
+		}
+	}
+	json_string(w, value, len);
+}
+
+/*	One member per command, keyed by its parameter name:
+ *	{
+ *	"data_rate":{"value":5,"status":"OK"},
+ *	"device_address":{"value":null,"status":"ERROR","error":"TIMEOUT"}
+ *	}
+ *	value is only there for gets. Returns 0 if the reply does not fit size.
+ */
+size_t reply_cmds_json(struct http_client *client, char *buf, size_t size)
+{
+	struct json_writer w;
 	struct command *cmd;
+	const char *error;
+
+	json_writer_init(&w, buf, size);
+	json_object_begin(&w);
 	STAILQ_FOREACH(cmd, client->cmdq_head, entries) {
-		strcpy(sptr++, "\"");
-		trim(cmd->buf, &cmd->buf_len);
-		strncpy(sptr, cmd->buf, cmd->buf_len);
-		sptr += cmd->buf_len;
-		strcpy(sptr++, "\"");
-		if (STAILQ_NEXT(cmd, entries))
-			strcpy(sptr++, ",");
-		strcpy(sptr++, "\n");
+		error = get_cmd_error(cmd);
+
+		json_key(&w, cmd->def.token, cmd->def.token_len);
+		json_object_begin(&w);
+		if (cmd->def.group == CMD_GET) {
+			json_key(&w, "value", sizeof("value") - 1);
+			if (error || !cmd->res.value_len)
+				json_null(&w);
+			else
+				reply_cmd_value(&w, cmd);
+		}
+		json_key(&w, "status", sizeof("status") - 1);
+		if (error) {
+			json_string(&w, "ERROR", sizeof("ERROR") - 1);
+			json_key(&w, "error", sizeof("error") - 1);
+			json_string(&w, error, strlen(error));
+		}
+		else
+			json_string(&w, "OK", sizeof("OK") - 1);
+		json_object_end(&w);
 	}
-	strcpy(sptr, "]\n");
-	return buf;
+	json_object_end(&w);
+
+	return w.overflow ? 0 : w.len;
 }
 
-int http_client_write(struct http_client *client, char *buf, size_t len)
+#define STATS_JSON_MAX 8192
+
+/* Appends s, as much of it as fits, and returns the length written */
+size_t put_stats(char *buf, size_t size, const char *s)
 {
-	size_t wlen;
-	wlen = write(client->fd, buf, len);
-	if (wlen < len) {
-		log(LOG_INFO, "short write, not all data echoed back to http client.\n");
+	int n = snprintf(buf, size, "%s", s);
+
+	if (n < 0)
+		return 0;
+	return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+/* Every part is clamped to what it wrote, so len never passes size */
+size_t reply_stats(struct lrwanatd *lw, char *buf, size_t size)
+{
+	size_t len = 0;
+
+	len += put_stats(buf, size, "{\n\"commands\": ");
+	len += rtt_stats_json(buf + len, size - len);
+	len += put_stats(buf + len, size - len, ",\n\"pools\": [\n");
+	len += pool_stats_json(&lw->pool.cmd, buf + len, size - len);
+	len += put_stats(buf + len, size - len, ",\n");
+	len += pool_stats_json(&lw->pool.uart_tx, buf + len, size - len);
+	len += put_stats(buf + len, size - len, "\n]\n}\n");
+	return len;
+}
+
+/*	Makes room for len more bytes at the end of the pending replies.
+ *	Fails if the reader is so far behind that out would grow past
+ *	HTTP_OUT_MAX.
+ */
+int http_conn_reserve(struct http_conn *conn, size_t len)
+{
+	size_t pending = conn->out_len - conn->out_off, size;
+	char *out;
+
+	if (pending + len > HTTP_OUT_MAX)
 		return RETURN_ERROR;
+
+	if (conn->out_off) {
+		memmove(conn->out, conn->out + conn->out_off, pending);
+		conn->out_len = pending;
+		conn->out_off = 0;
+	}
+
+	if (pending + len > conn->out_size) {
+		size = conn->out_size ? conn->out_size : HTTP_OUT_MIN;
+		while (size < pending + len)
+			size *= 2;
+		if (size > HTTP_OUT_MAX)
+			size = HTTP_OUT_MAX;
+		out = realloc(conn->out, size);
+		if (!out)
+			return RETURN_ERROR;
+		conn->out = out;
+		conn->out_size = size;
 	}
-	return wlen;
+	return RETURN_OK;
 }
 
-void set_http_client_uart_buf(struct lrwanatd *lw, char *buf, size_t len)
+/*	Writes as much of the pending replies as the socket takes, the rest
+ *	waits for on_write_http. A reader taking nothing for
+ *	HTTP_WRITE_TIMEOUT_MS is dropped there.
+ */
+int http_conn_flush(struct http_conn *conn)
 {
-	struct http_client *client;
-	struct command *cmd;
+	struct timeval timeout = {
+		HTTP_WRITE_TIMEOUT_MS / 1000, (HTTP_WRITE_TIMEOUT_MS % 1000) * 1000
+	};
+	ssize_t wlen;
+
+	/* MSG_NOSIGNAL, a peer gone away is an error and not a SIGPIPE */
+	wlen = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off,
+			MSG_NOSIGNAL);
+	if (wlen < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			log(LOG_INFO, "socket failure, disconnecting http client: %s",
+					strerror(errno));
+			return RETURN_ERROR;
+		}
+		wlen = 0;
+	}
 
-	client = STAILQ_FIRST(lw->http.http_clientq_head);
+	conn->out_off += wlen;
+	if (conn->out_off == conn->out_len) {
+		conn->out_len = conn->out_off = 0;
+		event_del(conn->write_event);
+	}
+	/* Re-adding would restart the timeout, it runs from the last progress */
+	else if (!event_pending(conn->write_event, EV_WRITE, NULL))
+		event_add(conn->write_event, &timeout);
 
-	/* If a client does not exist, then ignore the buf */
-	if (client && client->state != HTTP_CLIENT_ERROR)
-		set_active_cmd_uart_buf(client->cmdq_head, buf, len);
+	return RETURN_OK;
 }
 
-void free_http_client(struct lrwanatd *lw, struct http_client *client)
+/*	Drains the pending replies. A connection which was only waiting for
+ *	them to go out is closed once they have.
+ */
+void on_write_http(evutil_socket_t fd, short what, void *arg)
 {
-	if (!client->local) {
-		event_del(client->read_event);
-		event_free(client->read_event);
-		close(client->fd);
+	struct http_conn *conn = (struct http_conn *)arg;
+	struct lrwanatd *lw = global_lw;
+
+	if (what & EV_TIMEOUT) {
+		log(LOG_INFO, "http client not reading, %zu bytes pending, disconnecting.",
+				conn->out_len - conn->out_off);
+		close_http_conn(lw, conn);
+		return;
+	}
+
+	if (http_conn_flush(conn) < 0) {
+		close_http_conn(lw, conn);
+		return;
 	}
+
+	if (conn->closed && !conn->requests && conn->out_len == conn->out_off)
+		free_http_conn(conn);
+}
+
+/*	Replies are built in place: the body goes to http_reply_body(), at the
+ *	end of the connection's out buffer, and http_reply_commit() puts the
+ *	headers in front of it and starts writing. Room is left for the
+ *	headers, their length is only known once the body's is.
+ */
+char *http_reply_body(struct http_client *client, size_t size)
+{
+	struct http_conn *conn = client->conn;
+
+	if (http_conn_reserve(conn, HTTP_HEADER_MAX + size) < 0) {
+		log(LOG_INFO, "http client too slow, %zu bytes pending, disconnecting.",
+				conn->out_len - conn->out_off);
+		return NULL;
+	}
+	return conn->out + conn->out_len + HTTP_HEADER_MAX;
+}
+
+int http_reply_commit(struct http_client *client, const char *status, size_t len)
+{
+	struct http_conn *conn = client->conn;
+	char *header = conn->out + conn->out_len;
+	int n;
+
+	n = snprintf(header, HTTP_HEADER_MAX,
+			"HTTP/1.1 %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: %s\r\n\r\n",
+			status, len, client->keep_alive ? "keep-alive" : "close");
+
+	memmove(header + n, header + HTTP_HEADER_MAX, len);
+	conn->out_len += n + len;
+
+	return http_conn_flush(conn);
+}
+
+/*	Writes a complete response, headers and body. Fails if the peer is
+ *	gone or reads too slowly, the caller then closes the connection.
+ */
+int http_client_reply(struct http_client *client, const char *status,
+		const char *body, size_t len)
+{
+	char *buf = http_reply_body(client, len);
+
+	if (!buf)
+		return RETURN_ERROR;
+	memcpy(buf, body, len);
+	return http_reply_commit(client, status, len);
+}
+
+/*	Requests of a connection run one after the other and are answered in
+ *	the order they came in, a set is not overtaken by the send after it.
+ */
+bool http_client_reply_turn(struct http_client *client)
+{
+	return !client->conn || client->seq == client->conn->replied;
+}
+
+/* Frees a client which is not in http_clientq_head */
+void destroy_http_client(struct lrwanatd *lw, struct http_client *client)
+{
+	struct http_conn *conn = client->conn;
+
+	if (conn) {
+		if (conn->reading == client)
+			conn->reading = NULL;
+		if (!--conn->requests && conn->closed && conn->out_len == conn->out_off)
+			free_http_conn(conn);
+	}
+	/* Queued uart writes may still point into client->data */
+	uart_tx_release(lw, client);
+	if (client->data != client->buf)
+		free(client->data);
+	sched_release_client(lw, client);
+	if (lw->ctx_mngr.client == client)
+		lw->ctx_mngr.client = NULL;
 	free_cmd_queue(client->cmdq_head);
-	STAILQ_REMOVE(lw->http.http_clientq_head, client, http_client, entries);
 	free(client);
 }
 
+void free_http_client(struct lrwanatd *lw, struct http_client *client)
+{
+	STAILQ_REMOVE(lw->http.http_clientq_head, client, http_client, entries);
+	destroy_http_client(lw, client);
+}
+
 void remove_disconnected_http_clients(struct lrwanatd *lw)
 {
 	struct http_client *client, *client_next;
@@ -495,7 +1120,9 @@ void remove_disconnected_http_clients(struct lrwanatd *lw)
 
 	while(client != NULL) {
 		client_next = STAILQ_NEXT(client, entries);
-		if (client->state == HTTP_CLIENT_DISCONNECTED) {
+		/* The uart's is freed once its command is done, see close_http_conn */
+		if (client->state == HTTP_CLIENT_DISCONNECTED &&
+				client != lw->sched.uart_client) {
 			log(LOG_INFO, "removing http client.");
 			free_http_client(lw, client);
 		}
@@ -504,97 +1131,82 @@ void remove_disconnected_http_clients(struct lrwanatd *lw)
 }
 
 
-void process_http_clients(struct lrwanatd *lw)
+/* Writes the reply of a finished or failed request and frees the client */
+void reply_http_client(struct lrwanatd *lw, struct http_client *client)
 {
-	struct http_client *client;
-	struct command *cmd;
-	enum cmd_res_code cmdres;
-	char *httpres, *jsondata;
-
-	client = STAILQ_FIRST(lw->http.http_clientq_head);
-
-	if (client) {
-		/*	Two cases
-		*	1. Command has been successfully executed and all the incoming data has been parsed
-		*	2. TCP has error and connection closes midway
-		*/
-
-		if (client->state == HTTP_CLIENT_REQUEST_COMPLETE) {
-			cmd = STAILQ_FIRST(client->cmdq_head);
-			while(cmd && cmd->state != CMD_NEW) {
-				if (cmd->state == CMD_EXECUTING) {
-					cmdres = cmd->def.process_cmd(cmd);
-					switch (cmdres) {
-						case CMD_RES_TIMEOUT:
-							if (cmd->def.type != CMD_DELAY) {
-								client->timed_out = true;
-								log(LOG_INFO, "%p command timed out of type %d.", cmd, cmd->def.token);
-							}
-						case CMD_RES_OK:
-							cmd->state = CMD_EXECUTED;
-							log(LOG_INFO, "rx[len:%d]: %.*s", cmd->buf_len, cmd->buf_len, cmd->buf);
-							/* Clear the global buffer */
-							clear_uart_buf(&(lw->uart.buf_len));
-							/* Signal for store */
-							if (!client->timed_out)
-								context_manager_event(cmd->def.type, cmd);
-							break;
-						default:
-							break;
-					}
-					return;
-				} else if (cmd->state == CMD_ERROR) {
-					/* Send a bunch of new line to try recover from error. */
-					/* Rude-mentry */
-					log(LOG_INFO, "Command error!!!!!");
-					uart_write(lw, "\r\n\r\n\r\n\r\n", 8);
-					cmd->state = CMD_EXECUTED;
-					return;
-				}
-				cmd = STAILQ_NEXT(cmd, entries);
-			}
-
-			if(!cmd) {
-				if (client->local) {
-					/* If the client is local, there is no fd to write data to */
-					bool timed_out = client->timed_out;
-					bool restore_context = client->restore_context;
-					free_http_client(lw, client);
+	const char *status;
+	char *body;
+	size_t size, len;
+	int ret;
+
+	if (client->state != HTTP_CLIENT_REQUEST_COMPLETE) {
+		assert(!client->local);
+		/* Error, anything which is not active or request complete */
+		if (http_client_reply(client, client->error_status, client->error_body,
+				strlen(client->error_body)) < 0)
+			close_http_conn(lw, client->conn);
+		client->conn->replied++;
+		/* delete all commands */
+		free_http_client(lw, client);
+		return;
+	}
 
-					if (timed_out && restore_context) {
-						/* Generate context save again */
-						context_manager_event(CMD_RESET, NULL);
-					} else {
-						//context_manager_event(CMD_RESTORE_CONTEXT, NULL);
-					}
+	if (client->local) {
+		/* If the client is local, there is no fd to write data to */
+		bool timed_out = client->timed_out;
+		bool restore_context = client->restore_context;
+		free_http_client(lw, client);
+
+		if (timed_out && restore_context) {
+			/* Generate context save again */
+			context_manager_event(CMD_RESET, NULL);
+		} else {
+			//context_manager_event(CMD_RESTORE_CONTEXT, NULL);
+		}
 
-					return;
-				}
+		return;
+	}
 
-				if (client->timed_out)
-					httpres = "HTTP/1.1 504 Gateway Timeout\nContent-Type: application/json\n\n";
-				else
-					httpres = "HTTP/1.1 200 OK\nContent-Type: application/json\n\n";
+	if (client->timed_out)
+		status = "504 Gateway Timeout";
+	else
+		status = "200 OK";
 
-				jsondata = reply_get_cmds(client);
+	if (client->action == HTTP_STATS)
+		size = STATS_JSON_MAX;
+	else
+		size = reply_cmds_json_max(client);
 
-				http_client_write(client, httpres, strlen(httpres));
-				http_client_write(client, jsondata, strlen(jsondata));
+	ret = RETURN_ERROR;
+	if (size > HTTP_OUT_MAX - HTTP_HEADER_MAX) {
+		log(LOG_INFO, "reply of %zu bytes too large.", size);
+		set_http_error(client, HTTP_ERROR_500);
+	}
+	else if ((body = http_reply_body(client, size))) {
+		if (client->action == HTTP_STATS)
+			len = reply_stats(lw, body, size);
+		else
+			len = reply_cmds_json(client, body, size);
+
+		if (len)
+			ret = http_reply_commit(client, status, len);
+		else {
+			/* Nothing was committed, the error reply takes its place */
+			log(LOG_INFO, "reply larger than the %zu bytes expected.", size);
+			set_http_error(client, HTTP_ERROR_500);
+		}
+	}
 
-				free(jsondata);
+	if (client->state == HTTP_CLIENT_ERROR)
+		ret = http_client_reply(client, client->error_status, client->error_body,
+				strlen(client->error_body));
 
-                free_http_client(lw, client);
+	/* Whatever else the connection waits for is dropped with it */
+	if (ret < 0)
+		close_http_conn(lw, client->conn);
+	client->conn->replied++;
 
-			}
-		}
-		else if (client->state < HTTP_CLIENT_ACTIVE) {
-			assert(!client->local);
-			/* Disconnect, error, anything which is not active or request complete */
-			http_client_write(client, client->error_resp, strlen(client->error_resp));
-			/* delete all commands */
-			free_http_client(lw, client);
-		}
-	}
+	free_http_client(lw, client);
 }
 
 void setup_http_events(struct lrwanatd *lw)
@@ -4,138 +4,11 @@
 #define __COMMAND_H__
 #include <sys/queue.h>
 #include <time.h>
+#include <stdint.h>
 #include "lorawanatd.h"
 
-/* Reset the lora board */
-#define AT_CMD_RESET "ATZ"
-#define TOKEN_AT_RESET "reset"
-#define TOKEN_AT_HARD_RESET "hard_reset"
-
-/* Get OK status */
-#define AT_CMD "AT"
-#define TOKEN_AT "status"
-
-/* Get the device EUI */
-#define AT_CMD_DEUI "AT+DEUI"
-#define TOKEN_AT_DEUI "device_eui"
-
-/* Device Address */
-#define AT_CMD_DADDR "AT+DADDR"
-#define TOKEN_AT_DADDR "device_address"
-
-/* Application Key */
-#define AT_CMD_APPKEY "AT+APPKEY"
-#define TOKEN_AT_APPKEY "application_key"
-
-/* Network Session Key */
-#define AT_CMD_NWKSKEY "AT+NWKSKEY"
-#define TOKEN_AT_NWKSKEY "network_session_key"
-
-/* Application Session Key */
-#define AT_CMD_APPSKEY "AT+APPSKEY"
-#define TOKEN_AT_APPSKEY "application_session_key"
-
-/* App EUI */
-#define AT_CMD_APPEUI "AT+APPEUI"
-#define TOKEN_AT_APPEUI "application_eui"
-
-/* Adaptive Data Rate , 0: Disabled, 1: Enabled */
-#define AT_CMD_ADR "AT+ADR"
-#define TOKEN_AT_ADR "adaptive_data_rate"
-
-/* Transmit Power , 0 - 5 */
-#define AT_CMD_TXP "AT+TXP"
-#define TOKEN_AT_TXP "transmit_power"
-
-/* Data Rate , 0 - 7 */
-#define AT_CMD_DR "AT+DR"
-#define TOKEN_AT_DR "data_rate"
-
-/* RX2 window frequency */
-#define AT_CMD_RX2FQ "AT+RX2FQ"
-#define TOKEN_AT_RX2FQ "rx2_frequency"
-
-/* Rx2 window data rate, 0 - 7 */
-#define AT_CMD_RX2DR "AT+RX2DR"
-#define TOKEN_AT_RX2DR "rx2_data_rate"
-
-/* Delay between the end of tx and rx window 1 in ms */
-#define AT_CMD_RX1DL "AT+RX1DL"
-#define TOKEN_AT_RX1DL "rx1_delay"
-
-/* Delay between the end of tx and rx window 2 in ms */
-#define AT_CMD_RX2DL "AT+RX2DL"
-#define TOKEN_AT_RX2DL "rx2_delay"
-
-/* Join Accept Delay between the end of tx and join rx window 1 in ms */
-#define AT_CMD_JN1DL "AT+JN1DL"
-#define TOKEN_AT_JN1DL "join1_delay"
-
-/* Join Accept Delay between the end of tx and join rx window 2 in ms */
-#define AT_CMD_JN2DL "AT+JN2DL"
-#define TOKEN_AT_JN2DL "join2_delay"
-
-/* Network Join Mode, 0: ABP, 1: OTA */
-/* This should be handled by lorawanatd now */
-#define AT_CMD_NJM "AT+NJM"
-#define TOKEN_AT_NJM "network_join_mode"
-
-/* Network id */
-#define AT_CMD_NWKID "AT+NWKID"
-#define TOKEN_AT_NWKID "network_id"
-
-/* Class of device */
-#define AT_CMD_CLASS "AT+CLASS"
-#define TOKEN_AT_CLASS "class"
-
-/* Join */
-#define AT_CMD_JOIN "AT+JOIN"
-#define TOKEN_AT_JOIN "join"
-
-/* Network Join Status, 0: Not Joined, 1: Joined */
-#define AT_CMD_NJS "AT+NJS"
-#define TOKEN_AT_NJS "network_join_status"
-
-/* Send Hex */
-#define AT_CMD_SENDB "AT+SEND"
-#define TOKEN_AT_SENDB "sendb"
-
-/* Send Text */
-#define AT_CMD_SEND "AT+SEND"
-#define TOKEN_AT_SEND "send"
-
-/* Confirmation Mode, 0: No confirmation, 1: Confirmation */
-#define AT_CMD_CFM "AT+CFM"
-#define TOKEN_AT_CFM "confirmation_mode"
-
-/* Get confirmation status of last AT+SEND (0-1) */
-#define AT_CMD_CFS "AT+CFS"
-#define TOKEN_AT_CFS "confirmation_status"
-
-/* SNR */
-#define AT_CMD_SNR "AT+SNR"
-#define TOKEN_AT_SNR "snr"
-
-/* RSSI */
-#define AT_CMD_RSSI "AT+RSSI"
-#define TOKEN_AT_RSSI "rssi"
-
-/* Frame Counters [up]:[down] */
-#define AT_CMD_FCNT "AT+FCNT"
-#define TOKEN_AT_FCNT "frame_counter"
-
-/* Acquire and restore context */
-#define AT_CMD_CTX "AT+CTX"
-#define TOKEN_AT_CTX_ACQ "context_acquire"
-#define TOKEN_AT_CTX_RES "context_restore"
-
-/* Delay the board */
-#define AT_CMD_DELAY "DELAY"
-#define TOKEN_AT_DELAY "delay"
-
-/* Delay the board */
-#define AT_CMD_FORCE_UPDATE "FORCE_UPDATE"
-#define TOKEN_AT_FORCE_UPDATE "force_update"
+/* Commands, their tokens and AT strings are listed in command_spec.h */
+#include "command_spec.h"
 
 enum cmd_group {
 	CMD_ASYNC, /* Asynchronous events like RECV */
@@ -146,59 +19,10 @@ enum cmd_group {
 	CMD_INTERNAL, /* Internal commands, not exposed through HTTP API */
 };
 
+#define CMD_ENUM(type, ...) type,
+
 enum cmd_type {
-	CMD_RESET,
-	CMD_HARD_RESET,
-	CMD_STATUS,
-	CMD_JOIN,
-	CMD_GET_DEUI,
-	CMD_GET_DADDR,
-	CMD_GET_APPKEY,
-	CMD_GET_APPEUI,
-	CMD_GET_ADR,
-	CMD_GET_TXP,
-	CMD_GET_DR,
-	CMD_GET_RX2FQ,
-	CMD_GET_RX2DR,
-	CMD_GET_RX1DL,
-	CMD_GET_RX2DL,
-	CMD_GET_JN1DL,
-	CMD_GET_JN2DL,
-	CMD_GET_NJM,
-	CMD_GET_NWKID,
-	CMD_GET_CLASS,
-	CMD_GET_NJS,
-	CMD_GET_CFM,
-	CMD_GET_CFS,
-	CMD_GET_SNR,
-	CMD_GET_RSSI,
-	CMD_SET_DADDR,
-	CMD_SET_APPKEY,
-	CMD_SET_NWKSKEY,
-	CMD_SET_APPSKEY,
-	CMD_SET_APPEUI,
-	CMD_SET_ADR,
-	CMD_SET_TXP,
-	CMD_SET_DR,
-	CMD_SET_RX2FQ,
-	CMD_SET_RX2DR,
-	CMD_SET_RX1DL,
-	CMD_SET_RX2DL,
-	CMD_SET_JN1DL,
-	CMD_SET_JN2DL,
-	CMD_SET_NJM,
-	CMD_SET_NWKID,
-	CMD_SET_CLASS,
-	CMD_SET_CFM,
-	CMD_SET_FCNT,
-	CMD_SEND_TEXT,
-	CMD_SEND_BINARY,
-	CMD_ASYNC_RECV,
-	CMD_ASYNC_MORE_TX,
-	CMD_ACQUIRE_CONTEXT,
-	CMD_RESTORE_CONTEXT,
-	CMD_DELAY,
-    CMD_FORCE_UPDATE,
+	CMD_SPEC(CMD_ENUM)
 	CMD_TYPE_MAX,
 };
 
@@ -216,15 +40,78 @@ enum cmd_res_code {
 	CMD_RES_OK = 0,
 };
 
+/* Classification of a complete line received from the module */
+enum at_res_type {
+	AT_RES_NONE, /* nothing final seen yet */
+	AT_RES_OK,
+	AT_RES_PARAM_ERROR,
+	AT_RES_ERROR,
+	AT_RES_BUSY_ERROR,
+	AT_RES_NO_NETWORK_JOINED,
+	AT_RES_VALUE, /* anything else, e.g. the value of a get */
+	AT_RES_EVT, /* +EVT:... */
+	AT_RES_EVT_JOINED,
+	AT_RES_EVT_JOIN_FAILED,
+};
+
+/* Typed result, filled line by line as the response arrives */
+struct command_result {
+	enum at_res_type status; /* OK or one of the errors */
+	enum at_res_type event; /* join outcome, other +EVT lines are async */
+	size_t value_off; /* first value line, offset in buf */
+	size_t value_len;
+	size_t line_off; /* start of the line being received */
+	size_t scan_off; /* bytes of buf already tokenized */
+	bool timed_out; /* completed by its deadline, see complete_cmd */
+};
+
+/* Longest parameter value kept in the cache, keys are 47 characters */
+#define PARAM_CACHE_VALUE_MAX 64
+
+/* Longest rx line the async scanner keeps, a full LoRaWAN payload in hex fits */
+#define ASYNC_LINE_MAX 1024
+
+/* Structured record produced by the async scanner */
+struct async_evt {
+	enum cmd_type type; /* CMD_ASYNC_* */
+	const char *port;
+	size_t port_len;
+	const char *payload;
+	size_t payload_len;
+	const char *window; /* RX_1, RX_2, ... */
+	size_t window_len;
+	const char *rssi;
+	size_t rssi_len;
+	const char *snr;
+	size_t snr_len;
+	char *msg; /* preformatted by the regex fallback, otherwise NULL */
+};
+
 struct command_def; /* command definition */
 struct command;
 
-typedef char * (*construct_cmd_fp)(struct command *);
+typedef size_t (*construct_cmd_fp)(struct command *, char *buf, size_t size);
+typedef int (*construct_iov_fp)(struct command *, struct uart_tx *);
 typedef enum cmd_res_code (*process_cmd_fp)(struct command *);
-typedef void (*async_cmd_fp)(struct lrwanatd *lw, char *buf, size_t buflen);
+typedef void (*async_cmd_fp)(struct lrwanatd *lw, struct async_evt *evt);
 
 STAILQ_HEAD(cmd_queue_head, command);
 
+/* What a set accepts, see command_spec.h */
+enum param_check_type {
+	PARAM_ANY,
+	PARAM_RANGE,
+	PARAM_HEX_BYTES,
+	PARAM_ONE_OF,
+};
+
+struct param_check {
+	enum param_check_type type;
+	long min;
+	long max;
+	const char *one_of;
+};
+
 struct command_def {
 	enum cmd_type type;
 	enum cmd_group group;
@@ -232,10 +119,16 @@ struct command_def {
 	size_t token_len;
 	char *cmd;
 	size_t cmd_len;
-	construct_cmd_fp construct_cmd;
+	char *cmd_get; /* AT+XXX=? */
+	size_t cmd_get_len;
+	char *cmd_set; /* AT+XXX= */
+	size_t cmd_set_len;
+	construct_cmd_fp construct_cmd; /* reply of a local command */
+	construct_iov_fp construct_iov; /* command written to the module */
 	process_cmd_fp process_cmd;
 	async_cmd_fp async_cmd;
 	bool local_state;
+	struct param_check check;
 };
 
 struct command_param_set {
@@ -263,11 +156,17 @@ union command_param {
 struct command {
 	STAILQ_ENTRY(command) entries;
 	struct command_def def;
-	time_t epoc_timeout;
-	time_t timeout;
+	bool no_cache; /* go to the firmware even if the value is cached */
+	struct command *leader; /* in flight command whose result this one shares */
+	bool coalesced; /* the result came from another client's command */
+	uint64_t deadline; /* CLOCK_MONOTONIC ms, see set_cmd_deadline */
+	uint64_t sent; /* CLOCK_MONOTONIC ms, when it was handed to the uart */
+	unsigned int timeout; /* ms */
+	struct event *deadline_ev; /* fires a scheduler pass at the deadline */
 	union command_param param;
 	char buf[4196];
 	size_t buf_len;
+	struct command_result res;
 	enum cmd_state state;
 };
 
@@ -276,14 +175,42 @@ struct cmd_queue_head *init_cmd_queue();
 
 struct command *make_cmd(char *token, size_t token_len,
 		union  command_param *param,
-		time_t timeout_in_sec,
+		unsigned int timeout_ms,
 		enum cmd_group group);
 
-void run_async_cmd(struct lrwanatd *lw, char *buf, size_t buflen);
+struct command *make_type_cmd(enum cmd_type type,
+		union command_param *param,
+		unsigned int timeout_ms);
+
+int init_cmd_defs();
+
+struct command_def *lookup_cmd_def(const char *token, size_t token_len,
+		enum cmd_group group);
+
+bool check_cmd_param(struct command_def *def, const char *param, size_t len);
+
+void run_async_cmd(struct lrwanatd *lw);
+
+void set_cmd_uart_buf(struct command *cmd, char *buf, size_t len);
+
+void run_local_cmd(struct command *cmd);
+
+struct command_def *get_cmd_def(enum cmd_type type);
+
+bool cmd_waits_for_response(struct command *cmd);
+
+const char *get_cmd_error(struct command *cmd);
+
+bool param_cache_serve(struct command *cmd);
+
+void param_cache_update(struct command *cmd);
+
+enum at_res_type classify_at_line(const char *line, size_t len);
 
-void set_active_cmd_uart_buf(struct cmd_queue_head *cmdq_head, char *buf, size_t len);
+int init_regex(struct lrwanatd *lw);
 
-void clear_uart_buf(size_t *buflen);
+bool scan_evt_payload(const char *line, size_t len, struct async_evt *evt);
+bool scan_evt_rx(const char *line, size_t len, struct async_evt *evt);
 
 void free_cmd_queue(struct cmd_queue_head *cmdq_head);
 #endif
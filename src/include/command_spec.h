@@ -0,0 +1,92 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#ifndef __COMMAND_SPEC_H__
+#define __COMMAND_SPEC_H__
+
+/*	Every command the daemon knows, described once.
+ *
+ *	X(type, group, token, at, construct_cmd, construct_iov, process_cmd,
+ *	  async_cmd, local_state, check)
+ *
+ *	type and the order give enum cmd_type, the row is its entry in
+ *	cmd_def_list, token is the name used by the HTTP API and at the AT
+ *	command sent for it. Commands for the module are written by
+ *	construct_iov, local ones answer through construct_cmd. check is what
+ *	a set accepts, anything else is answered with AT_PARAM_ERROR without
+ *	going to the module. For a get it describes the value, a CHECK_RANGE
+ *	value is replied as a JSON number, see reply_cmds_json:
+ *
+ *	CHECK_ANY              no check
+ *	CHECK_RANGE(min, max)  decimal integer within [min, max]
+ *	CHECK_HEX(n)           n bytes in hex, plain or as ':' separated pairs
+ *	CHECK_ONE_OF(chars)    a single character out of chars
+ */
+
+#define CHECK_ANY				{ PARAM_ANY, 0, 0, NULL }
+#define CHECK_RANGE(min, max)	{ PARAM_RANGE, min, max, NULL }
+#define CHECK_HEX(n)			{ PARAM_HEX_BYTES, n, n, NULL }
+#define CHECK_ONE_OF(chars)		{ PARAM_ONE_OF, 0, 0, chars }
+
+#define CMD_SPEC(X) \
+	/* Actions */ \
+	X(CMD_RESET, CMD_ACTION, "reset", "ATZ", NULL, construct_raw_iov, wait_for_good_timeout, NULL, false, CHECK_ANY) \
+	X(CMD_HARD_RESET, CMD_ACTION, "hard_reset", "ATZ", NULL, construct_raw_iov, wait_for_good_timeout, NULL, false, CHECK_ANY) \
+	X(CMD_STATUS, CMD_ACTION, "status", "AT", NULL, construct_raw_iov, wait_for_ok_or_timeout, NULL, false, CHECK_ANY) \
+	X(CMD_JOIN, CMD_ACTION, "join", "AT+JOIN", NULL, construct_join_iov, wait_for_joined_or_timeout, NULL, false, CHECK_ANY) \
+	/* Gets */ \
+	X(CMD_GET_DEUI, CMD_GET, "device_eui", "AT+DEUI", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(8)) \
+	X(CMD_GET_DADDR, CMD_GET, "device_address", "AT+DADDR", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(4)) \
+	X(CMD_GET_APPKEY, CMD_GET, "application_key", "AT+APPKEY", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(16)) \
+	X(CMD_GET_APPEUI, CMD_GET, "application_eui", "AT+APPEUI", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(8)) \
+	X(CMD_GET_ADR, CMD_GET, "adaptive_data_rate", "AT+ADR", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 1)) \
+	X(CMD_GET_TXP, CMD_GET, "transmit_power", "AT+TXP", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 5)) \
+	X(CMD_GET_DR, CMD_GET, "data_rate", "AT+DR", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 7)) \
+	X(CMD_GET_RX2FQ, CMD_GET, "rx2_frequency", "AT+RX2FQ", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(137000000, 1020000000)) \
+	X(CMD_GET_RX2DR, CMD_GET, "rx2_data_rate", "AT+RX2DR", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 7)) \
+	X(CMD_GET_RX1DL, CMD_GET, "rx1_delay", "AT+RX1DL", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 65535)) \
+	X(CMD_GET_RX2DL, CMD_GET, "rx2_delay", "AT+RX2DL", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 65535)) \
+	X(CMD_GET_JN1DL, CMD_GET, "join1_delay", "AT+JN1DL", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 65535)) \
+	X(CMD_GET_JN2DL, CMD_GET, "join2_delay", "AT+JN2DL", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 65535)) \
+	X(CMD_GET_NJM, CMD_GET, "network_join_mode", "AT+NJM", get_njm_cmd, NULL, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 1)) \
+	X(CMD_GET_NWKID, CMD_GET, "network_id", "AT+NWKID", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 127)) \
+	X(CMD_GET_CLASS, CMD_GET, "class", "AT+CLASS", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_ONE_OF("ABC")) \
+	X(CMD_GET_NJS, CMD_GET, "network_join_status", "AT+NJS", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 1)) \
+	X(CMD_GET_CFM, CMD_GET, "confirmation_mode", "AT+CFM", get_cfm_cmd, NULL, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 1)) \
+	X(CMD_GET_CFS, CMD_GET, "confirmation_status", "AT+CFS", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 1)) \
+	X(CMD_GET_SNR, CMD_GET, "snr", "AT+SNR", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(-128, 127)) \
+	X(CMD_GET_RSSI, CMD_GET, "rssi", "AT+RSSI", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(-255, 0)) \
+	/* Sets, the mac params are kept locally until a join, see set_mac_params */ \
+	X(CMD_SET_DADDR, CMD_SET, "device_address", "AT+DADDR", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(4)) \
+	X(CMD_SET_APPKEY, CMD_SET, "application_key", "AT+APPKEY", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(16)) \
+	X(CMD_SET_NWKSKEY, CMD_SET, "network_session_key", "AT+NWKSKEY", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(16)) \
+	X(CMD_SET_APPSKEY, CMD_SET, "application_session_key", "AT+APPSKEY", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(16)) \
+	X(CMD_SET_APPEUI, CMD_SET, "application_eui", "AT+APPEUI", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_HEX(8)) \
+	X(CMD_SET_ADR, CMD_SET, "adaptive_data_rate", "AT+ADR", construct_mac_param_cmd, construct_set_iov, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 1)) \
+	X(CMD_SET_TXP, CMD_SET, "transmit_power", "AT+TXP", construct_mac_param_cmd, construct_set_iov, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 5)) \
+	X(CMD_SET_DR, CMD_SET, "data_rate", "AT+DR", construct_mac_param_cmd, construct_set_iov, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 7)) \
+	X(CMD_SET_RX2FQ, CMD_SET, "rx2_frequency", "AT+RX2FQ", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(137000000, 1020000000)) \
+	X(CMD_SET_RX2DR, CMD_SET, "rx2_data_rate", "AT+RX2DR", construct_mac_param_cmd, construct_set_iov, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 7)) \
+	X(CMD_SET_RX1DL, CMD_SET, "rx1_delay", "AT+RX1DL", construct_mac_param_cmd, construct_set_iov, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 65535)) \
+	X(CMD_SET_RX2DL, CMD_SET, "rx2_delay", "AT+RX2DL", construct_mac_param_cmd, construct_set_iov, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 65535)) \
+	X(CMD_SET_JN1DL, CMD_SET, "join1_delay", "AT+JN1DL", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 65535)) \
+	X(CMD_SET_JN2DL, CMD_SET, "join2_delay", "AT+JN2DL", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 65535)) \
+	X(CMD_SET_NJM, CMD_SET, "network_join_mode", "AT+NJM", set_njm_cmd, NULL, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 1)) \
+	X(CMD_SET_NWKID, CMD_SET, "network_id", "AT+NWKID", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_RANGE(0, 127)) \
+	X(CMD_SET_CLASS, CMD_SET, "class", "AT+CLASS", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_ONE_OF("ABC")) \
+	X(CMD_SET_CFM, CMD_SET, "confirmation_mode", "AT+CFM", set_cfm_cmd, NULL, wait_for_ok_or_timeout, NULL, true, CHECK_RANGE(0, 1)) \
+	X(CMD_SET_FCNT, CMD_SET, "frame_counter", "AT+FCNT", NULL, construct_set_iov, wait_for_ok_or_timeout, NULL, false, CHECK_ANY) \
+	/* Uplinks */ \
+	X(CMD_SEND_TEXT, CMD_SEND, "send", "AT+SEND", NULL, construct_send_iov, wait_for_ok_or_timeout, NULL, false, CHECK_ANY) \
+	X(CMD_SEND_BINARY, CMD_SEND, "sendb", "AT+SEND", NULL, construct_send_iov, wait_for_ok_or_timeout, NULL, false, CHECK_ANY) \
+	/* Events from the module, see dispatch_async_evt */ \
+	X(CMD_ASYNC_RECV, CMD_ASYNC, "", "", NULL, NULL, NULL, async_recv, false, CHECK_ANY) \
+	X(CMD_ASYNC_MORE_TX, CMD_ASYNC, "", "", NULL, NULL, NULL, async_has_more_tx, false, CHECK_ANY) \
+	X(CMD_ASYNC_JOINED, CMD_ASYNC, "", "", NULL, NULL, NULL, async_join_evt, false, CHECK_ANY) \
+	X(CMD_ASYNC_JOIN_FAILED, CMD_ASYNC, "", "", NULL, NULL, NULL, async_join_evt, false, CHECK_ANY) \
+	/* Internal, not exposed through the HTTP API */ \
+	X(CMD_ACQUIRE_CONTEXT, CMD_INTERNAL, "context_acquire", "AT+CTX", NULL, construct_get_iov, wait_for_ok_or_timeout, NULL, false, CHECK_ANY) \
+	X(CMD_RESTORE_CONTEXT, CMD_INTERNAL, "context_restore", "AT", NULL, construct_context_restore_iov, wait_for_ok_or_timeout, NULL, false, CHECK_ANY) \
+	X(CMD_DELAY, CMD_INTERNAL, "delay", "DELAY", construct_delay_cmd, NULL, wait_for_good_timeout, NULL, true, CHECK_ANY) \
+	X(CMD_FORCE_UPDATE, CMD_INTERNAL, "force_update", "FORCE_UPDATE", construct_force_update_cmd, NULL, wait_for_good_timeout, NULL, true, CHECK_ANY)
+
+#endif
@@ -48,5 +48,6 @@ struct command;
 
 void context_manager_init(struct context_manager *ctx_mngr);
 void context_manager_event(enum cmd_type cmd_type, struct command *cmd);
+void context_acquired(struct command *cmd);
 
 #endif /* __CONTEXT_MANAGER_H__ */
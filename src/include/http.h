@@ -9,17 +9,21 @@
 
 STAILQ_HEAD(http_client_queue_head, http_client);
 
+/* Routes of the HTTP API are listed in http_routes.h */
+#include "http_routes.h"
+
+#define HTTP_ROUTE_ENUM(action, ...) action,
+
 enum http_action {
 	HTTP_UNDEFINED,
-	HTTP_RESET,
-	HTTP_HARD_RESET,
-	HTTP_STATUS,
-	HTTP_JOIN,
-	HTTP_GET_CONFIG,
-	HTTP_SET_CONFIG,
-	HTTP_SEND_DATA,
-	HTTP_SENDB_DATA,
-    HTTP_FORCE_UPDATE,
+	HTTP_ROUTE_SPEC(HTTP_ROUTE_ENUM)
+	HTTP_ACTION_MAX
+};
+
+/* What a route expects in the body of its requests */
+enum http_body {
+	HTTP_BODY_NONE,
+	HTTP_BODY_JSON,
 };
 
 enum http_client_state {
@@ -39,38 +43,79 @@ struct http_request_def {
 	size_t header_len;
 };
 
+/*	A persistent connection. Every request read from it becomes an
+ *	http_client, run and answered in the order the requests came in.
+ *	Replies are written into out and sent from there, what the socket
+ *	does not take at once is drained by write_event.
+ */
+struct http_conn {
+	int fd;
+	struct event *read_event;
+	struct event *write_event;
+	char *out; /* replies not yet sent, allocated on first use */
+	size_t out_size;
+	size_t out_len;
+	size_t out_off; /* out[0, out_off) is already written */
+	struct http_client *reading; /* request being received, if any */
+	unsigned int requests; /* clients of the connection not yet freed */
+	unsigned long received; /* requests read so far, numbers them */
+	unsigned long replied; /* requests answered so far */
+	bool closed; /* nothing more is read, closed with its last client and reply */
+};
+
 struct http_client {
 	STAILQ_ENTRY(http_client) entries;
+	STAILQ_ENTRY(http_client) sched_entries; /* lane while waiting for the uart */
+	enum sched_lane lane;
+	bool sched_queued;
 	int fd; // file descriptor
-	struct event *read_event;
+	struct http_conn *conn; /* NULL for local clients */
+	unsigned long seq; /* position of the request on the connection */
+	bool keep_alive; /* the connection stays open after the reply */
 	struct cmd_queue_head *cmdq_head; // commands for this client
-	unsigned char buf[8196];
-	size_t buf_len;
+	unsigned char buf[8196]; /* headers, and the body if it fits */
+	unsigned char *data; /* buf, or the heap copy of a request too large for it */
+	size_t data_size;
+	size_t buf_len; /* bytes received in data */
 	enum http_action action;
 	struct http_request_def request;
 	enum http_client_state state;
 	bool is_json;
+	bool no_cache; /* Cache-Control: no-cache, read from the firmware */
 	bool timed_out;
-	char error_resp[255];
+	const char *error_status; /* reply of a failed request */
+	const char *error_body;
 	bool local; /* True if client in an internal client */
 	bool restore_context; /* True if client is trying to restore context */
 };
 
 struct http_client_queue_head *init_http_client_queue();
 
+int init_http_routes();
+
+enum http_action get_action_from_http_request(struct http_client *client);
+
 void setup_http_events(struct lrwanatd * lw);
 
 int init_http_listen_sock(int port);
 
-int http_client_write(struct http_client *client, char* buf, size_t len);
+int http_client_reply(struct http_client *client, const char *status,
+		const char *body, size_t len);
 
-void set_http_client_uart_buf(struct lrwanatd *lw, char *buf, size_t len);
+bool http_client_reply_turn(struct http_client *client);
 
-void process_http_clients(struct lrwanatd *lw);
+void reply_http_client(struct lrwanatd *lw, struct http_client *client);
 
 void remove_disconnected_http_clients(struct lrwanatd *lw);
 
 struct http_client * create_http_client(struct lrwanatd *lw, int fd);
 
+int parse_json_content_add_cmd(struct http_client *client);
+
+size_t reply_cmds_json_max(struct http_client *client);
+
+size_t reply_cmds_json(struct http_client *client, char *buf, size_t size);
+
+void destroy_http_client(struct lrwanatd *lw, struct http_client *client);
 void free_http_client(struct lrwanatd *lw, struct http_client *client);
 #endif
@@ -0,0 +1,34 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#ifndef __HTTP_ROUTES_H__
+#define __HTTP_ROUTES_H__
+
+/*	Every route of the HTTP API, described once.
+ *
+ *	X(action, name, method, path, body, add_cmds, cmd, timeout_ms)
+ *
+ *	action and the order give enum http_action, the row is its entry in
+ *	http_route_list. A request matches a route only if its method and path
+ *	are exactly method and path. body is what the request must carry:
+ *
+ *	HTTP_BODY_NONE  anything sent is ignored
+ *	HTTP_BODY_JSON  a JSON body, parsed before add_cmds is called
+ *
+ *	add_cmds queues the commands of the request, cmd and timeout_ms are
+ *	what it makes them with; CMD_TYPE_MAX when they come from the body.
+ *	Routes answered by the daemon itself have no add_cmds.
+ */
+
+#define HTTP_ROUTE_SPEC(X) \
+	X(HTTP_RESET, "Reset", "GET", "/reset", HTTP_BODY_NONE, add_route_cmd, CMD_RESET, 10000) \
+	X(HTTP_HARD_RESET, "Hard Reset", "GET", "/hard_reset", HTTP_BODY_NONE, add_route_cmd, CMD_HARD_RESET, 10000) \
+	X(HTTP_STATUS, "Status", "GET", "/status", HTTP_BODY_NONE, add_route_cmd, CMD_STATUS, 0) \
+	X(HTTP_JOIN, "Join", "GET", "/join", HTTP_BODY_NONE, add_route_cmd, CMD_JOIN, 60000) \
+	X(HTTP_GET_CONFIG, "Get Config", "POST", "/config/get", HTTP_BODY_JSON, add_get_config_cmds, CMD_TYPE_MAX, 60000) \
+	X(HTTP_SET_CONFIG, "Set Config", "POST", "/config/set", HTTP_BODY_JSON, add_set_config_cmds, CMD_TYPE_MAX, 60000) \
+	X(HTTP_SEND_DATA, "Send Data", "POST", "/send", HTTP_BODY_JSON, add_send_cmd, CMD_SEND_TEXT, 0) \
+	X(HTTP_SENDB_DATA, "Send Binary Data", "POST", "/sendb", HTTP_BODY_JSON, add_send_cmd, CMD_SEND_BINARY, 0) \
+	X(HTTP_FORCE_UPDATE, "Force Update", "GET", "/force_update", HTTP_BODY_NONE, add_route_cmd, CMD_FORCE_UPDATE, 1000) \
+	X(HTTP_STATS, "Stats", "GET", "/stats", HTTP_BODY_NONE, NULL, CMD_TYPE_MAX, 0)
+
+#endif
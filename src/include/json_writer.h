@@ -0,0 +1,41 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#ifndef __JSON_WRITER_H__
+#define __JSON_WRITER_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*	Streaming JSON writer over a caller supplied buffer. Values are
+ *	appended as they come, commas and escaping are taken care of, and the
+ *	members of the outermost object go one per line. Nothing is ever
+ *	written past size; once something does not fit the writer stops and
+ *	overflow is set, buf then holds no valid document.
+ */
+struct json_writer {
+	char *buf;
+	size_t size;
+	size_t len;
+	bool overflow;
+	bool comma; /* a value is open at this level, the next needs a comma */
+	unsigned int depth; /* objects open */
+};
+
+/* Worst case length of a string of len bytes once escaped and quoted */
+#define JSON_STRING_MAX(len) (6 * (len) + 2)
+
+void json_writer_init(struct json_writer *w, char *buf, size_t size);
+
+void json_object_begin(struct json_writer *w);
+
+void json_object_end(struct json_writer *w);
+
+void json_key(struct json_writer *w, const char *key, size_t len);
+
+void json_string(struct json_writer *w, const char *s, size_t len);
+
+void json_int(struct json_writer *w, long value);
+
+void json_null(struct json_writer *w);
+
+#endif
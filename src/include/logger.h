@@ -17,7 +17,7 @@ static inline void _log(int priority, const char *file, const int line, const ch
   struct timeval t;
   gettimeofday(&t, NULL);
 	va_start(args, fmt);
-	vsprintf(buf, fmt, args);
+	vsnprintf(buf, sizeof(buf), fmt, args);
 	va_end(args);
 #ifdef PSTDOUT
 	printf("[%d][%ld.%ld]%s:%d:%s\n", getpid(), t.tv_sec, t.tv_usec, file, line, buf);
@@ -4,11 +4,14 @@
 #define __LORAWANATD_H__
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <event2/event.h>
 #include <sys/epoll.h>
 #include <stdbool.h>
 #include <regex.h>
 #include "context_manager.h"
+#include "ringbuf.h"
+#include "pool.h"
 
 /* Function return status */
 enum {
@@ -29,18 +32,28 @@ struct event_def {
 
 STAILQ_HEAD(uart_tx_queue_head, uart_tx);
 
+#define UART_TX_IOV_MAX 8
+
+/* Power of two, see ringbuf.h */
+#define UART_RX_BUF_SIZE 8192
+
+/* One queued write, a scatter list of segments that are not copied */
 struct uart_tx {
 	STAILQ_ENTRY(uart_tx) entries;
-	char buf[1024];
-	size_t buf_len;
+	struct iovec iov[UART_TX_IOV_MAX];
+	int iovcnt;
+	int iov_idx; /* first segment not fully written */
+	size_t iov_off; /* bytes of iov[iov_idx] already written */
+	void *owner; /* segments may point into this, see uart_tx_release */
+	char *heap; /* copy made by uart_tx_release, freed once written */
 };
 
 struct uart_def {
 	int fd;
 	char file[255];
 	unsigned int baudrate;
-	char buf[8149];
-	size_t buf_len;
+	struct ringbuf rx; /* unconsumed rx bytes, scanned for async events */
+	char rx_buf[UART_RX_BUF_SIZE + 1];
 	struct uart_tx_queue_head tx_q;
 #if 0
 	int epfd_in; /* epoll fd */
@@ -61,6 +74,40 @@ struct push_def {
 	struct push_callbacks *cb;
 };
 
+/* Scheduler lanes, highest priority first */
+enum sched_lane {
+	SCHED_LANE_RESTORE, /* firmware context restore, nothing works before it */
+	SCHED_LANE_UPLINK, /* /send and /sendb */
+	SCHED_LANE_CONFIG, /* interactive get, set and actions */
+	SCHED_LANE_BACKGROUND, /* context acquisition */
+	SCHED_LANE_MAX,
+};
+
+STAILQ_HEAD(sched_lane_head, http_client);
+
+/* Daemon wide command scheduler, see scheduler.c */
+/* Compile time caps of the object pools, allocated in full at startup */
+#ifndef CMD_POOL_SIZE
+#define CMD_POOL_SIZE 128
+#endif
+
+#ifndef UART_TX_POOL_SIZE
+#define UART_TX_POOL_SIZE 32
+#endif
+
+struct pool_def {
+	struct pool cmd; /* struct command */
+	struct pool uart_tx; /* struct uart_tx */
+};
+
+struct sched_def {
+	struct http_client *uart_client; /* client the uart belongs to, if any */
+	struct command *uart_cmd; /* command waiting for its response */
+	struct sched_lane_head lanes[SCHED_LANE_MAX]; /* clients waiting for the uart */
+	unsigned int passed[SCHED_LANE_MAX]; /* dispatches since the lane was served */
+	bool rerun; /* a pass made progress others may wait on, see schedule_cmds */
+};
+
 /* All compiled regex goes here */
 struct regex_def {
 	regex_t recv;
@@ -75,6 +122,8 @@ struct lrwanatd {
 	struct uart_def uart;
 	struct http_def http;
 	struct push_def push;
+	struct sched_def sched;
+	struct pool_def pool;
 	struct regex_def regex;
 	struct context_manager ctx_mngr;
 };
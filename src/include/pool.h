@@ -0,0 +1,40 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+
+/*	Fixed size object pool carved out of a single allocation made at
+ *	startup. Free objects are chained through their first bytes. The pool
+ *	never grows, running out is counted and left to the caller.
+ */
+struct pool {
+	const char *name;
+	size_t size; /* of an object, rounded up for alignment */
+	size_t cap; /* objects */
+	char *mem;
+	void *free_list;
+	size_t in_use;
+	size_t high_water;
+	unsigned long allocs;
+	unsigned long exhausted; /* allocations refused */
+};
+
+int pool_init(struct pool *pool, const char *name, size_t size, size_t cap);
+
+void pool_destroy(struct pool *pool);
+
+void *pool_alloc(struct pool *pool);
+
+void pool_free(struct pool *pool, void *obj);
+
+size_t pool_stats_json(struct pool *pool, char *buf, size_t size);
+
+struct lrwanatd;
+
+int init_pools(struct lrwanatd *lw);
+
+void destroy_pools(struct lrwanatd *lw);
+
+#endif
@@ -0,0 +1,34 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#ifndef __RINGBUF_H__
+#define __RINGBUF_H__
+
+#include <stddef.h>
+
+/*	Byte ring with free running produce/consume offsets.
+ *	size has to be a power of two, storage has to hold size + 1 bytes
+ *	so that a linearized view can always be NUL terminated.
+ */
+struct ringbuf {
+	char *buf;
+	size_t size;
+	size_t head; /* consume offset */
+	size_t tail; /* produce offset */
+};
+
+void ringbuf_init(struct ringbuf *rb, char *storage, size_t size);
+
+void ringbuf_reset(struct ringbuf *rb);
+
+size_t ringbuf_write(struct ringbuf *rb, const char *buf, size_t len);
+
+void ringbuf_consume(struct ringbuf *rb, size_t len);
+
+char *ringbuf_linearize(struct ringbuf *rb);
+
+static inline size_t ringbuf_len(const struct ringbuf *rb)
+{
+	return rb->tail - rb->head;
+}
+
+#endif
@@ -0,0 +1,19 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#ifndef __RTT_H__
+#define __RTT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct command;
+
+unsigned int rtt_cmd_timeout(struct command *cmd);
+
+void rtt_record(struct command *cmd, uint64_t rtt);
+
+void rtt_timed_out(struct command *cmd);
+
+size_t rtt_stats_json(char *buf, size_t size);
+
+#endif
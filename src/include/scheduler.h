@@ -0,0 +1,18 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include "lorawanatd.h"
+
+struct http_client;
+
+void init_scheduler(struct lrwanatd *lw);
+
+void schedule_cmds(struct lrwanatd *lw);
+
+void set_sched_uart_buf(struct lrwanatd *lw, char *buf, size_t len);
+
+void sched_release_client(struct lrwanatd *lw, struct http_client *client);
+
+#endif
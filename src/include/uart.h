@@ -14,6 +14,22 @@ void set_mincount(int fd, int mcount);
 
 int uart_write(struct lrwanatd *lw, char *buf, size_t len);
 
+struct uart_tx *uart_tx_new(struct lrwanatd *lw, void *owner);
+
+int uart_tx_add(struct uart_tx *tx, const void *buf, size_t len);
+
+void uart_tx_submit(struct lrwanatd *lw, struct uart_tx *tx);
+
+void uart_tx_free(struct lrwanatd *lw, struct uart_tx *tx);
+
+int uart_tx_release(struct lrwanatd *lw, void *owner);
+
+size_t uart_tx_len(struct uart_tx *tx);
+
+char *uart_tx_str(struct uart_tx *tx, char *buf, size_t size);
+
+void uart_reset(struct lrwanatd *lw, bool teardown);
+
 void setup_uart_events(struct lrwanatd * lw);
 
 #endif
@@ -0,0 +1,122 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#include <stdio.h>
+#include <string.h>
+#include "json_writer.h"
+
+void json_writer_init(struct json_writer *w, char *buf, size_t size)
+{
+	w->buf = buf;
+	w->size = size;
+	w->len = 0;
+	w->overflow = false;
+	w->comma = false;
+	w->depth = 0;
+}
+
+void json_put(struct json_writer *w, const char *s, size_t len)
+{
+	if (w->overflow || len > w->size - w->len) {
+		w->overflow = true;
+		return;
+	}
+	memcpy(w->buf + w->len, s, len);
+	w->len += len;
+}
+
+/* Separates a value, or a key, from the one before it */
+void json_separate(struct json_writer *w)
+{
+	if (w->comma)
+		json_put(w, w->depth == 1 ? ",\n" : ",", w->depth == 1 ? 2 : 1);
+	w->comma = true;
+}
+
+void json_object_begin(struct json_writer *w)
+{
+	json_separate(w);
+	json_put(w, "{", 1);
+	if (!w->depth++)
+		json_put(w, "\n", 1);
+	w->comma = false;
+}
+
+void json_object_end(struct json_writer *w)
+{
+	if (!--w->depth)
+		json_put(w, "\n}\n", 3);
+	else
+		json_put(w, "}", 1);
+	w->comma = true;
+}
+
+void json_quote(struct json_writer *w, const char *s, size_t len)
+{
+	const char *run = s;
+	char esc[8];
+	size_t i;
+	unsigned char c;
+
+	json_put(w, "\"", 1);
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		/* Plain bytes go out in runs, escapes one at a time */
+		json_put(w, run, s + i - run);
+		run = s + i + 1;
+		switch (c) {
+			case '"':
+				json_put(w, "\\\"", 2);
+				break;
+			case '\\':
+				json_put(w, "\\\\", 2);
+				break;
+			case '\n':
+				json_put(w, "\\n", 2);
+				break;
+			case '\r':
+				json_put(w, "\\r", 2);
+				break;
+			case '\t':
+				json_put(w, "\\t", 2);
+				break;
+			default:
+				snprintf(esc, sizeof(esc), "\\u%04x", c);
+				json_put(w, esc, 6);
+				break;
+		}
+	}
+	json_put(w, run, s + len - run);
+	json_put(w, "\"", 1);
+}
+
+void json_key(struct json_writer *w, const char *key, size_t len)
+{
+	json_separate(w);
+	json_quote(w, key, len);
+	json_put(w, ":", 1);
+	w->comma = false;
+}
+
+void json_string(struct json_writer *w, const char *s, size_t len)
+{
+	json_separate(w);
+	json_quote(w, s, len);
+}
+
+void json_int(struct json_writer *w, long value)
+{
+	char num[24];
+	int n = snprintf(num, sizeof(num), "%ld", value);
+
+	json_separate(w);
+	json_put(w, num, n);
+}
+
+void json_null(struct json_writer *w)
+{
+	json_separate(w);
+	json_put(w, "null", 4);
+}
@@ -13,6 +13,8 @@
 #include "http.h"
 #include "push.h"
 #include "util.h"
+#include "command.h"
+#include "scheduler.h"
 
 struct lrwanatd *global_lw;
 
@@ -71,19 +73,6 @@ int parse_opts(struct lrwanatd *lw, int argc, char **argv)
 	return RETURN_OK;
 }
 
-//static const char *recv_pattern = "\\+EVT:([0-9]+):([a-f0-9]+)..#FCNTDOWN:([0-9]+)#..\\+EVT:[A-Z0-9]+, RSSI (-?[0-9]+), SNR (-?[0-9]+)..";
-
-static const char *recv_pattern = "\\+EVT:([0-9]+):[0-9]+:([a-f0-9]+)..\\+EVT:(RX_[0-9]), DR [0-9], RSSI (-?[0-9]+), SNR (-?[0-9]+)..";
-int init_regex(struct lrwanatd *lw)
-{
-	if (regcomp(&lw->regex.recv, recv_pattern, REG_EXTENDED)) {
-		log(LOG_ERR, "cannot compile regex: recv_pattern.");
-		return RETURN_ERROR;
-	}
-	lw->regex.n_recv_grps = 6; // 5 match groups + 1
-	return RETURN_OK;
-}
-
 int init(struct lrwanatd *lw, int argc, char **argv)
 {
 	lw->pid = getpid();
@@ -114,6 +103,15 @@ int init(struct lrwanatd *lw, int argc, char **argv)
 	if (init_regex(lw) == RETURN_ERROR)
 		return RETURN_ERROR;
 
+	if (init_cmd_defs() == RETURN_ERROR)
+		return RETURN_ERROR;
+
+	if (init_http_routes() == RETURN_ERROR)
+		return RETURN_ERROR;
+
+	if (init_pools(lw) == RETURN_ERROR)
+		return RETURN_ERROR;
+
 		/* libevent */
 #ifdef EVENT_LOG
 	event_enable_debug_logging(EVENT_DBG_ALL);
@@ -133,6 +131,9 @@ void clean(struct lrwanatd *lw)
 	event_del(lw->event.uart_read);
 	event_free(lw->event.uart_read);
 
+	event_del(lw->event.uart_write);
+	event_free(lw->event.uart_write);
+
 	event_del(lw->event.timer_processor);
 	event_free(lw->event.timer_processor);
 
@@ -147,6 +148,8 @@ void clean(struct lrwanatd *lw)
 
 	regfree(&lw->regex.recv);
 
+	destroy_pools(lw);
+
 	free(lw);
 }
 
@@ -181,6 +184,7 @@ int main(int argc, char **argv)
 	setup_uart_events(global_lw);
 	setup_http_events(global_lw);
 	setup_push_events(global_lw);
+	init_scheduler(global_lw);
 
 	context_manager_init(&global_lw->ctx_mngr);
 
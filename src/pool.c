@@ -0,0 +1,110 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include "pool.h"
+#include "lorawanatd.h"
+#include "command.h"
+#include "logger.h"
+
+#define POOL_ALIGN sizeof(void *)
+
+int pool_init(struct pool *pool, const char *name, size_t size, size_t cap)
+{
+	size_t i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->name = name;
+	pool->size = (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+	pool->cap = cap;
+
+	/* All of it up front, the heap is not touched again */
+	pool->mem = calloc(cap, pool->size);
+	if (!pool->mem) {
+		log(LOG_ERR, "cannot allocate the %s pool: %s", name, strerror(errno));
+		return RETURN_ERROR;
+	}
+
+	for (i = cap; i > 0; i--) {
+		void **obj = (void **)(pool->mem + (i - 1) * pool->size);
+		*obj = pool->free_list;
+		pool->free_list = obj;
+	}
+
+	return RETURN_OK;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	free(pool->mem);
+	pool->mem = pool->free_list = NULL;
+}
+
+/* Returns a zeroed object, NULL with errno ENOMEM when the pool is empty */
+void *pool_alloc(struct pool *pool)
+{
+	void **obj = pool->free_list;
+
+	if (!obj) {
+		if (!pool->exhausted++)
+			log(LOG_ERR, "%s pool exhausted, %zu in use.", pool->name, pool->in_use);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pool->free_list = *obj;
+	memset(obj, 0, pool->size);
+
+	pool->allocs++;
+	if (++pool->in_use > pool->high_water)
+		pool->high_water = pool->in_use;
+
+	return obj;
+}
+
+void pool_free(struct pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+
+	assert((char *)obj >= pool->mem && (char *)obj < pool->mem + pool->cap * pool->size);
+
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->in_use--;
+}
+
+size_t pool_stats_json(struct pool *pool, char *buf, size_t size)
+{
+	int n = snprintf(buf, size,
+			"{\"pool\": \"%s\", \"size\": %zu, \"cap\": %zu, \"in_use\": %zu, "
+			"\"high_water\": %zu, \"allocs\": %lu, \"exhausted\": %lu}",
+			pool->name, pool->size, pool->cap, pool->in_use,
+			pool->high_water, pool->allocs, pool->exhausted);
+
+	if (n < 0)
+		return 0;
+	return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+int init_pools(struct lrwanatd *lw)
+{
+	if (pool_init(&lw->pool.cmd, "command", sizeof(struct command), CMD_POOL_SIZE) ||
+			pool_init(&lw->pool.uart_tx, "uart_tx", sizeof(struct uart_tx), UART_TX_POOL_SIZE))
+		return RETURN_ERROR;
+
+	log(LOG_INFO, "pools: %d commands, %d uart writes, %zu bytes.",
+			CMD_POOL_SIZE, UART_TX_POOL_SIZE,
+			lw->pool.cmd.cap * lw->pool.cmd.size +
+			lw->pool.uart_tx.cap * lw->pool.uart_tx.size);
+	return RETURN_OK;
+}
+
+void destroy_pools(struct lrwanatd *lw)
+{
+	pool_destroy(&lw->pool.cmd);
+	pool_destroy(&lw->pool.uart_tx);
+}
@@ -0,0 +1,90 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+#include <string.h>
+#include <assert.h>
+#include "ringbuf.h"
+
+void ringbuf_init(struct ringbuf *rb, char *storage, size_t size)
+{
+	assert(size && !(size & (size - 1)));
+	rb->buf = storage;
+	rb->size = size;
+	rb->head = rb->tail = 0;
+	rb->buf[0] = '\0';
+}
+
+void ringbuf_reset(struct ringbuf *rb)
+{
+	rb->head = rb->tail = 0;
+	rb->buf[0] = '\0';
+}
+
+/* Returns the number of old bytes dropped to make room */
+size_t ringbuf_write(struct ringbuf *rb, const char *buf, size_t len)
+{
+	size_t dropped = 0, pos, n;
+
+	if (len > rb->size) {
+		/* Only the newest bytes can fit */
+		dropped = len - rb->size;
+		buf += dropped;
+		len = rb->size;
+	}
+
+	if (len > rb->size - ringbuf_len(rb)) {
+		n = len - (rb->size - ringbuf_len(rb));
+		rb->head += n;
+		dropped += n;
+	}
+
+	while (len) {
+		pos = rb->tail & (rb->size - 1);
+		n = rb->size - pos;
+		if (n > len)
+			n = len;
+		memcpy(rb->buf + pos, buf, n);
+		rb->tail += n;
+		buf += n;
+		len -= n;
+	}
+
+	return dropped;
+}
+
+void ringbuf_consume(struct ringbuf *rb, size_t len)
+{
+	if (len > ringbuf_len(rb))
+		len = ringbuf_len(rb);
+	rb->head += len;
+}
+
+static void ringbuf_reverse(char *buf, size_t len)
+{
+	char c, *end = buf + len - 1;
+
+	while (buf < end) {
+		c = *buf;
+		*buf++ = *end;
+		*end-- = c;
+	}
+}
+
+/* Contiguous, NUL terminated view of the unread bytes */
+char *ringbuf_linearize(struct ringbuf *rb)
+{
+	size_t len = ringbuf_len(rb);
+	size_t pos = rb->head & (rb->size - 1);
+
+	if (pos + len > rb->size) {
+		/* Wrapped, rotate the storage so the data starts at 0 */
+		ringbuf_reverse(rb->buf, pos);
+		ringbuf_reverse(rb->buf + pos, rb->size - pos);
+		ringbuf_reverse(rb->buf, rb->size);
+		rb->head = 0;
+		rb->tail = len;
+		pos = 0;
+	}
+
+	rb->buf[pos + len] = '\0';
+	return rb->buf + pos;
+}
@@ -0,0 +1,183 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+/*	Round trip times of the commands answered by the module, per command
+ *	type, and the timeouts learned from them.
+ *
+ *	The last RTT_SAMPLES round trips of each type are kept. Once there are
+ *	RTT_MIN_SAMPLES of them, a command times out after RTT_MARGIN times
+ *	their p99, no sooner than RTT_TIMEOUT_FLOOR and no later than the
+ *	timeout it was made with. Each timeout in a row doubles that, so a
+ *	module that merely slowed down is not given up on for good.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rtt.h"
+#include "command.h"
+#include "logger.h"
+
+#define RTT_SAMPLES 64
+#define RTT_MIN_SAMPLES 8
+#define RTT_MARGIN 4
+#define RTT_TIMEOUT_FLOOR 2000 /* ms */
+#define RTT_MAX_BACKOFF 8 /* doublings */
+
+struct rtt_stat {
+	uint32_t samples[RTT_SAMPLES]; /* ms, ring */
+	size_t n_samples;
+	size_t head;
+	uint32_t max;
+	unsigned long count;
+	unsigned long timeouts;
+	unsigned int misses; /* timeouts in a row */
+};
+
+static struct rtt_stat rtt_stats[CMD_TYPE_MAX];
+
+int cmp_rtt(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of the samples kept */
+uint32_t rtt_percentile(struct rtt_stat *stat, unsigned int p)
+{
+	uint32_t sorted[RTT_SAMPLES];
+	size_t rank;
+
+	memcpy(sorted, stat->samples, stat->n_samples * sizeof(sorted[0]));
+	qsort(sorted, stat->n_samples, sizeof(sorted[0]), cmp_rtt);
+
+	rank = (p * stat->n_samples + 99) / 100;
+	return sorted[rank ? rank - 1 : 0];
+}
+
+/* Learned timeout of the type, 0 until there are enough samples */
+unsigned int rtt_learned_timeout(struct rtt_stat *stat)
+{
+	unsigned int timeout, misses;
+
+	if (stat->n_samples < RTT_MIN_SAMPLES)
+		return 0;
+
+	timeout = rtt_percentile(stat, 99) * RTT_MARGIN;
+	if (timeout < RTT_TIMEOUT_FLOOR)
+		timeout = RTT_TIMEOUT_FLOOR;
+
+	misses = stat->misses < RTT_MAX_BACKOFF ? stat->misses : RTT_MAX_BACKOFF;
+	return timeout << misses;
+}
+
+unsigned int rtt_cmd_timeout(struct command *cmd)
+{
+	unsigned int timeout;
+
+	if (!cmd_waits_for_response(cmd))
+		return cmd->timeout;
+
+	timeout = rtt_learned_timeout(&rtt_stats[cmd->def.type]);
+	if (!timeout || timeout > cmd->timeout)
+		return cmd->timeout;
+
+	return timeout;
+}
+
+void rtt_record(struct command *cmd, uint64_t rtt)
+{
+	struct rtt_stat *stat = &rtt_stats[cmd->def.type];
+
+	if (!cmd_waits_for_response(cmd))
+		return;
+
+	stat->samples[stat->head] = rtt;
+	stat->head = (stat->head + 1) % RTT_SAMPLES;
+	if (stat->n_samples < RTT_SAMPLES)
+		stat->n_samples++;
+	if (rtt > stat->max)
+		stat->max = rtt;
+	stat->count++;
+	stat->misses = 0;
+}
+
+void rtt_timed_out(struct command *cmd)
+{
+	struct rtt_stat *stat = &rtt_stats[cmd->def.type];
+
+	if (!cmd_waits_for_response(cmd))
+		return;
+
+	stat->timeouts++;
+	stat->misses++;
+	log(LOG_INFO, "%s timed out after %u ms, %u in a row.",
+			cmd->def.token, cmd->timeout, stat->misses);
+}
+
+char *get_cmd_group_string(enum cmd_group group)
+{
+	switch (group) {
+		case CMD_ACTION:
+			return "action";
+		case CMD_GET:
+			return "get";
+		case CMD_SET:
+			return "set";
+		case CMD_SEND:
+			return "send";
+		case CMD_INTERNAL:
+			return "internal";
+		default:
+			return "async";
+	}
+}
+
+/* What snprintf of size put into the buffer, like pool_stats_json */
+size_t rtt_clamp(int n, size_t size)
+{
+	if (n < 0)
+		return 0;
+	return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+/* A json list with one entry per command type seen so far */
+size_t rtt_stats_json(char *buf, size_t size)
+{
+	size_t len = 0;
+	struct rtt_stat *stat;
+	struct command_def *def;
+	enum cmd_type type;
+	int n;
+
+	if (size < 8)
+		return 0;
+
+	n = snprintf(buf, size, "[\n");
+	len += rtt_clamp(n, size);
+
+	for (type = 0; type < CMD_TYPE_MAX; type++) {
+		stat = &rtt_stats[type];
+		def = get_cmd_def(type);
+		if (!def || (!stat->count && !stat->timeouts))
+			continue;
+
+		n = snprintf(buf + len, size - len,
+				"%s{\"command\": \"%s\", \"group\": \"%s\", \"count\": %lu, "
+				"\"timeouts\": %lu, \"p50\": %u, \"p99\": %u, \"max\": %u, "
+				"\"timeout\": %u}",
+				len > 2 ? ",\n" : "", def->token,
+				get_cmd_group_string(def->group), stat->count, stat->timeouts,
+				stat->n_samples ? rtt_percentile(stat, 50) : 0,
+				stat->n_samples ? rtt_percentile(stat, 99) : 0,
+				stat->max, rtt_learned_timeout(stat));
+		/* Keep room for the closing bracket */
+		if (n < 0 || n >= size - len - 3)
+			break;
+		len += n;
+	}
+
+	n = snprintf(buf + len, size - len, "\n]");
+	len += rtt_clamp(n, size - len);
+	return len;
+}
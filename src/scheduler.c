@@ -0,0 +1,476 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+/*	Daemon wide command scheduler.
+ *
+ *	Every client with a complete request has its commands run in order, but
+ *	clients no longer wait for each other. Local state commands never touch
+ *	the uart and complete as soon as their client reaches them, and so do
+ *	commands the parameter cache can answer.
+ *
+ *	Identical get and status commands share a single uart execution. A
+ *	command arriving while its twin is in flight, or waiting for the uart
+ *	when its twin is started, follows it and gets a copy of its result,
+ *	unless a set of the same parameter is still to be done.
+ *
+ *	The uart takes one command at a time. A client waiting for it sits in
+ *	the lane of its next command, FIFO within the lane, and the lanes are
+ *	served by priority. A lane passed over SCHED_MAX_PASSES times in a row
+ *	is served next, so a pending /send waits for at most one lower
+ *	priority command per SCHED_MAX_PASSES uplinks. The context restore
+ *	keeps the uart until it is done, its sequence must not be interleaved.
+ *
+ *	Passes are driven by events, not by the tick: a complete request, the
+ *	end of a response seen by the rx tokenizer, and deadlines. Deadlines
+ *	are monotonic milliseconds. Every command waiting on one has a libevent
+ *	timer that runs a pass when it expires. A response is thus answered,
+ *	and the next command written, in the loop iteration it arrived in.
+ */
+
+#include <string.h>
+#include "scheduler.h"
+#include "http.h"
+#include "command.h"
+#include "uart.h"
+#include "util.h"
+#include "rtt.h"
+#include "logger.h"
+
+#define SCHED_MAX_PASSES 4
+
+/* Recovery sequence after a command could not be written */
+#define UART_RECOVER "\r\n\r\n\r\n\r\n"
+
+struct command *current_cmd(struct http_client *client)
+{
+	struct command *cmd;
+
+	STAILQ_FOREACH(cmd, client->cmdq_head, entries)
+		if (cmd->state != CMD_EXECUTED)
+			return cmd;
+	return NULL;
+}
+
+enum sched_lane cmd_lane(struct http_client *client, struct command *cmd)
+{
+	if (client->restore_context)
+		return SCHED_LANE_RESTORE;
+
+	switch (cmd->def.group) {
+		case CMD_SEND:
+			return SCHED_LANE_UPLINK;
+		case CMD_INTERNAL:
+			return SCHED_LANE_BACKGROUND;
+		default:
+			return SCHED_LANE_CONFIG;
+	}
+}
+
+void sched_enqueue(struct lrwanatd *lw, struct http_client *client,
+		struct command *cmd)
+{
+	if (client->sched_queued)
+		return;
+
+	client->lane = cmd_lane(client, cmd);
+	client->sched_queued = true;
+	STAILQ_INSERT_TAIL(&lw->sched.lanes[client->lane], client, sched_entries);
+}
+
+void sched_dequeue(struct lrwanatd *lw, struct http_client *client)
+{
+	if (!client->sched_queued)
+		return;
+
+	STAILQ_REMOVE(&lw->sched.lanes[client->lane], client, http_client, sched_entries);
+	client->sched_queued = false;
+}
+
+void release_uart(struct lrwanatd *lw, struct http_client *client)
+{
+	lw->sched.uart_cmd = NULL;
+	/* The restore holds on to the uart until it is done */
+	if (!client->restore_context)
+		lw->sched.uart_client = NULL;
+}
+
+void cb_cmd_deadline(evutil_socket_t fd, short what, void *arg)
+{
+	schedule_cmds((struct lrwanatd *)arg);
+}
+
+void arm_cmd_deadline(struct lrwanatd *lw, struct command *cmd)
+{
+	struct timeval tv;
+	uint64_t now = monotonic_ms(), left;
+
+	if (!cmd->deadline_ev)
+		cmd->deadline_ev = evtimer_new(lw->event.base, cb_cmd_deadline, lw);
+	if (!cmd->deadline_ev)
+		return; /* the tick still catches it */
+
+	left = cmd->deadline > now ? cmd->deadline - now : 0;
+	tv.tv_sec = left / 1000;
+	tv.tv_usec = (left % 1000) * 1000;
+	evtimer_add(cmd->deadline_ev, &tv);
+}
+
+/* Returns true if a set of the parameter get reads is yet to be done */
+bool set_pending(struct lrwanatd *lw, struct command *get)
+{
+	struct http_client *client;
+	struct command *cmd;
+
+	STAILQ_FOREACH(client, lw->http.http_clientq_head, entries)
+		STAILQ_FOREACH(cmd, client->cmdq_head, entries)
+			if (cmd->def.group == CMD_SET && cmd->state != CMD_EXECUTED &&
+					cmd->def.token_len == get->def.token_len &&
+					!memcmp(cmd->def.token, get->def.token, get->def.token_len))
+				return true;
+	return false;
+}
+
+bool is_coalescible(struct lrwanatd *lw, struct http_client *client,
+		struct command *cmd)
+{
+	if (client->restore_context)
+		return false;
+
+	/*	Reads only, the type says it all. Two resets or joins asked for are
+	 *	two, and a get must not share a read made before a set it queued
+	 *	behind.
+	 */
+	if (cmd->def.type == CMD_STATUS)
+		return true;
+	return cmd->def.group == CMD_GET && !set_pending(lw, cmd);
+}
+
+void follow_cmd(struct lrwanatd *lw, struct command *cmd, struct command *leader)
+{
+	log(LOG_INFO, "%p follows %p of type %d.", cmd, leader, cmd->def.type);
+	cmd->leader = leader;
+	cmd->coalesced = true;
+	/* Never constructed, shares the deadline of the leader */
+	cmd->deadline = leader->deadline;
+	arm_cmd_deadline(lw, cmd);
+	cmd->state = CMD_EXECUTING;
+}
+
+/*	Hands the result of the leader to every command following it. A NULL
+ *	buf sends the followers back to the queue to run on their own.
+ */
+void release_followers(struct lrwanatd *lw, struct command *leader,
+		char *buf, size_t len, bool timed_out)
+{
+	struct http_client *client;
+	struct command *cmd;
+
+	STAILQ_FOREACH(client, lw->http.http_clientq_head, entries) {
+		cmd = current_cmd(client);
+		if (!cmd || cmd->leader != leader)
+			continue;
+
+		cmd->leader = NULL;
+		if (!buf) {
+			cmd->coalesced = false;
+			cmd->state = CMD_NEW;
+			continue;
+		}
+
+		set_cmd_uart_buf(cmd, buf, len);
+		/* Time out along with the leader, see wait_for_timeout */
+		if (timed_out)
+			cmd->deadline = 0;
+		/* Followers earlier in the client queue were already passed */
+		lw->sched.rerun = true;
+	}
+}
+
+/* Returns true once the command is done */
+bool complete_cmd(struct lrwanatd *lw, struct http_client *client, struct command *cmd)
+{
+	enum cmd_res_code ret = cmd->def.process_cmd(cmd);
+
+	switch (ret) {
+		case CMD_RES_TIMEOUT:
+			if (cmd->def.type != CMD_DELAY) {
+				client->timed_out = true;
+				cmd->res.timed_out = true;
+				log(LOG_INFO, "%p command timed out of type %s.", cmd, cmd->def.token);
+			}
+			/* fall through */
+		case CMD_RES_OK:
+			cmd->state = CMD_EXECUTED;
+			if (cmd->deadline_ev)
+				evtimer_del(cmd->deadline_ev);
+			log(LOG_INFO, "rx[len:%d]: %.*s", cmd->buf_len, cmd->buf_len, cmd->buf);
+			if (cmd == lw->sched.uart_cmd) {
+				if (ret == CMD_RES_TIMEOUT)
+					rtt_timed_out(cmd);
+				else
+					rtt_record(cmd, monotonic_ms() - cmd->sent);
+				param_cache_update(cmd);
+				release_followers(lw, cmd, cmd->buf, cmd->buf_len, client->timed_out);
+				release_uart(lw, client);
+			}
+			/* Signal for store, the leader already did */
+			if (!client->timed_out && !cmd->coalesced) {
+				context_manager_event(cmd->def.type, cmd);
+				/* It may have queued a local client */
+				lw->sched.rerun = true;
+			}
+			return true;
+		default:
+			/* The timer may fire just short of the deadline */
+			if (cmd->deadline_ev && !evtimer_pending(cmd->deadline_ev, NULL))
+				arm_cmd_deadline(lw, cmd);
+			return false;
+	}
+}
+
+void start_local_cmd(struct command *cmd)
+{
+	/* These commands run locally and not on the LoRa hardware */
+	run_local_cmd(cmd);
+}
+
+/* Takes the twins of the command just started off the lanes */
+void follow_queued(struct lrwanatd *lw, struct command *leader)
+{
+	struct http_client *client, *client_next;
+	struct command *cmd;
+	enum sched_lane lane;
+
+	for (lane = 0; lane < SCHED_LANE_MAX; lane++) {
+		client = STAILQ_FIRST(&lw->sched.lanes[lane]);
+		while (client != NULL) {
+			client_next = STAILQ_NEXT(client, sched_entries);
+			cmd = current_cmd(client);
+			if (cmd->def.type == leader->def.type && is_coalescible(lw, client, cmd)) {
+				sched_dequeue(lw, client);
+				follow_cmd(lw, cmd, leader);
+			}
+			client = client_next;
+		}
+	}
+}
+
+void start_uart_cmd(struct lrwanatd *lw, struct http_client *client,
+		struct command *cmd)
+{
+	struct uart_tx *tx;
+	char line[256];
+
+	if (cmd->def.type == CMD_RESET)
+		uart_reset(lw, true);
+
+	/* Learned from the round trips so far, see rtt.c */
+	cmd->timeout = rtt_cmd_timeout(cmd);
+
+	/* Segments may point into the client buffer, see free_http_client */
+	tx = uart_tx_new(lw, client);
+	if (!tx) {
+		/* Out of uart writes, the command fails like a write error */
+		cmd->state = CMD_EXECUTED;
+		lw->sched.rerun = true;
+		return;
+	}
+
+	// Write enter key
+	if (cmd->def.construct_iov(cmd, tx) == RETURN_ERROR ||
+			uart_tx_add(tx, "\r\n", 2) == RETURN_ERROR) {
+		uart_tx_free(lw, tx);
+		/* Send a bunch of new line to try recover from error. */
+		log(LOG_INFO, "Command error!!!!!");
+		uart_write(lw, UART_RECOVER, sizeof(UART_RECOVER) - 1);
+		cmd->state = CMD_EXECUTED;
+		lw->sched.rerun = true;
+		return;
+	}
+
+	log(LOG_INFO, "tx[len:%zu]: %s", uart_tx_len(tx),
+			uart_tx_str(tx, line, sizeof(line)));
+
+	uart_tx_submit(lw, tx);
+	cmd->sent = monotonic_ms();
+	cmd->state = CMD_EXECUTING;
+	arm_cmd_deadline(lw, cmd);
+	lw->sched.uart_cmd = cmd;
+	lw->sched.uart_client = client;
+
+	if (is_coalescible(lw, client, cmd))
+		follow_queued(lw, cmd);
+}
+
+/*	Runs the client's commands as far as possible without the uart.
+ *	Returns true when all of them are executed.
+ */
+bool run_client_cmds(struct lrwanatd *lw, struct http_client *client)
+{
+	struct command *cmd;
+
+	while ((cmd = current_cmd(client)) != NULL) {
+		if (cmd->state == CMD_NEW) {
+			if (cmd->def.local_state || param_cache_serve(cmd)) {
+				start_local_cmd(cmd);
+				/* Delays wait for their deadline */
+				if (!complete_cmd(lw, client, cmd)) {
+					arm_cmd_deadline(lw, cmd);
+					return false;
+				}
+				continue;
+			}
+			else if (lw->sched.uart_cmd &&
+					cmd->def.type == lw->sched.uart_cmd->def.type &&
+					is_coalescible(lw, client, cmd))
+				follow_cmd(lw, cmd, lw->sched.uart_cmd);
+			else {
+				/* Waits for its turn, see dispatch_uart_cmd */
+				sched_enqueue(lw, client, cmd);
+				return false;
+			}
+		}
+
+		if (!complete_cmd(lw, client, cmd))
+			return false;
+	}
+	return true;
+}
+
+enum sched_lane pick_lane(struct lrwanatd *lw)
+{
+	struct sched_def *sched = &lw->sched;
+	enum sched_lane lane, pick = SCHED_LANE_MAX;
+
+	/* The restore goes first no matter how long the others waited */
+	if (!STAILQ_EMPTY(&sched->lanes[SCHED_LANE_RESTORE]))
+		return SCHED_LANE_RESTORE;
+
+	for (lane = 0; lane < SCHED_LANE_MAX; lane++) {
+		if (STAILQ_EMPTY(&sched->lanes[lane]))
+			continue;
+		if (pick == SCHED_LANE_MAX || sched->passed[lane] >= SCHED_MAX_PASSES) {
+			pick = lane;
+			if (sched->passed[lane] >= SCHED_MAX_PASSES)
+				break;
+		}
+	}
+
+	/* Every other waiting lane was passed over once more */
+	for (lane = 0; lane < SCHED_LANE_MAX; lane++) {
+		if (lane == pick)
+			sched->passed[lane] = 0;
+		else if (!STAILQ_EMPTY(&sched->lanes[lane]))
+			sched->passed[lane]++;
+	}
+
+	return pick;
+}
+
+void dispatch_uart_cmd(struct lrwanatd *lw)
+{
+	struct http_client *client;
+	enum sched_lane lane;
+
+	if (lw->sched.uart_cmd)
+		return;
+
+	client = lw->sched.uart_client;
+	if (client) {
+		/* Held by the restore in between its commands */
+		if (client->sched_queued) {
+			sched_dequeue(lw, client);
+			start_uart_cmd(lw, client, current_cmd(client));
+		}
+		return;
+	}
+
+	lane = pick_lane(lw);
+	if (lane == SCHED_LANE_MAX)
+		return;
+
+	client = STAILQ_FIRST(&lw->sched.lanes[lane]);
+	sched_dequeue(lw, client);
+	/* Its connection closed while it waited, see close_http_conn */
+	if (client->state != HTTP_CLIENT_REQUEST_COMPLETE) {
+		lw->sched.rerun = true;
+		return;
+	}
+	start_uart_cmd(lw, client, current_cmd(client));
+}
+
+void init_scheduler(struct lrwanatd *lw)
+{
+	enum sched_lane lane;
+
+	lw->sched.uart_client = NULL;
+	lw->sched.uart_cmd = NULL;
+	lw->sched.rerun = false;
+	for (lane = 0; lane < SCHED_LANE_MAX; lane++) {
+		STAILQ_INIT(&lw->sched.lanes[lane]);
+		lw->sched.passed[lane] = 0;
+	}
+}
+
+void schedule_cmds(struct lrwanatd *lw)
+{
+	struct http_client *client, *client_next;
+
+	do {
+		lw->sched.rerun = false;
+		client = STAILQ_FIRST(lw->http.http_clientq_head);
+
+		while (client != NULL) {
+			client_next = STAILQ_NEXT(client, entries);
+
+			/*	Two cases
+			*	1. Command has been successfully executed and all the incoming data has been parsed
+			*	2. Request could not be parsed
+			*/
+			if (client->state == HTTP_CLIENT_DISCONNECTED) {
+				/* Gone, but the uart is still busy with its command */
+				if (client == lw->sched.uart_client && lw->sched.uart_cmd)
+					complete_cmd(lw, client, lw->sched.uart_cmd);
+			}
+			else if (!http_client_reply_turn(client)) {
+				/* Pipelined, waits for the requests before it */
+			}
+			else if (client->state == HTTP_CLIENT_REQUEST_COMPLETE) {
+				if (run_client_cmds(lw, client))
+					reply_http_client(lw, client);
+			}
+			else if (client->state == HTTP_CLIENT_ERROR)
+				reply_http_client(lw, client);
+
+			client = client_next;
+		}
+
+		dispatch_uart_cmd(lw);
+	} while (lw->sched.rerun);
+}
+
+void set_sched_uart_buf(struct lrwanatd *lw, char *buf, size_t len)
+{
+	struct command *cmd = lw->sched.uart_cmd;
+
+	/* Nobody is waiting for the bytes, async events are scanned separately */
+	if (!cmd)
+		return;
+
+	set_cmd_uart_buf(cmd, buf, len);
+
+	/* The tokenizer saw a final line, finish the command right away */
+	if (cmd->res.status != AT_RES_NONE || cmd->res.event != AT_RES_NONE)
+		schedule_cmds(lw);
+}
+
+void sched_release_client(struct lrwanatd *lw, struct http_client *client)
+{
+	sched_dequeue(lw, client);
+	if (lw->sched.uart_client == client) {
+		/* Its followers run on their own now */
+		if (lw->sched.uart_cmd)
+			release_followers(lw, lw->sched.uart_cmd, NULL, 0, false);
+		lw->sched.uart_client = NULL;
+		lw->sched.uart_cmd = NULL;
+	}
+}
@@ -13,12 +13,22 @@
 #include "http.h"
 #include "push.h"
 #include "util.h"
+#include "scheduler.h"
 
 // 0.5 sec
 #define TIMER_USEC_INTERVAL 500000
 // 0.5 sec
 #define READ_DELAY_USEC 500000
 
+/* Segments gathered into a single writev */
+#define UART_WRITEV_MAX 64
+
+/* Ends a command cut short, see uart_tx_release */
+#define UART_LINE_END "\r\n"
+
+void cb_write(evutil_socket_t fd, short what, void *arg);
+void uart_dev_error(struct lrwanatd *lw, const char *op, const char *reason);
+
 int set_interface_attribs(int fd, speed_t speed)
 {
 	struct termios tty;
@@ -43,9 +53,9 @@ int set_interface_attribs(int fd, speed_t speed)
 	tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
 	tty.c_oflag &= ~OPOST;
 
-	/* fetch bytes as they become available */
+	/* fetch bytes as they become available, never wait inside read() */
 	tty.c_cc[VMIN] = 0;
-	tty.c_cc[VTIME] = 2; // 0.5 seconds
+	tty.c_cc[VTIME] = 0;
 
 	if (tcsetattr(fd, TCSANOW, &tty) != 0) {
 		log(LOG_INFO, "error from tcsetattr: %s\n", strerror(errno));
@@ -74,66 +84,180 @@ void set_mincount(int fd, int mcount)
 
 #endif
 
-int uart_write(struct lrwanatd *lw, char *buf, size_t len)
+struct uart_tx *uart_tx_new(struct lrwanatd *lw, void *owner)
 {
-	struct uart_tx *tx = malloc(sizeof(struct uart_tx));
-	strncpy(tx->buf, buf, len);
-	tx->buf_len = len;
-	STAILQ_INSERT_TAIL(&lw->uart.tx_q, tx, entries);
-	return len;
+	struct uart_tx *tx = pool_alloc(&lw->pool.uart_tx);
+
+	if (tx)
+		tx->owner = owner;
+	return tx;
 }
 
-void remove_disconnected_clients(struct lrwanatd *lw)
+int uart_tx_add(struct uart_tx *tx, const void *buf, size_t len)
 {
-	remove_disconnected_push_clients(lw);
-	remove_disconnected_http_clients(lw);
+	if (tx->iovcnt == UART_TX_IOV_MAX)
+		return RETURN_ERROR;
+
+	if (!len)
+		return RETURN_OK;
+
+	tx->iov[tx->iovcnt].iov_base = (void *)buf;
+	tx->iov[tx->iovcnt].iov_len = len;
+	tx->iovcnt++;
+	return RETURN_OK;
 }
 
-#define READ_SIZE 1
-#if 0
-void cb_read(evutil_socket_t fd, short what, void *arg)
+size_t uart_tx_len(struct uart_tx *tx)
 {
-	struct lrwanatd *lw;
-	char buf[READ_SIZE];
-	int ret;
+	size_t len = 0;
+	int i;
 
-	lw = (struct lrwanatd *)arg;
+	for (i = tx->iov_idx; i < tx->iovcnt; i++)
+		len += tx->iov[i].iov_len;
 
-	ret = read(fd, buf, READ_SIZE);
-	if (ret <= 0)
-		return;
-	else if(ret != 1)
-		log(LOG_INFO, "read size = %d and not 1.", ret);
+	return len - tx->iov_off;
+}
 
-	/*	While reading, check for asynchronous events.
-	 *	Then clean the buffer. Then pass it to client if possible.
+/*	All segments of the write in buf, for the log. Cut short to fit size,
+ *	the line end is left out.
+ */
+char *uart_tx_str(struct uart_tx *tx, char *buf, size_t size)
+{
+	size_t len = 0;
+	int i, n;
+
+	buf[0] = '\0';
+	for (i = 0; i < tx->iovcnt && len < size - 1; i++) {
+		n = snprintf(buf + len, size - len, "%.*s", (int)tx->iov[i].iov_len,
+				(char *)tx->iov[i].iov_base);
+		if (n < 0)
+			break;
+		len += n;
+	}
+	if (len > size - 1)
+		len = size - 1;
+
+	while (len && (buf[len - 1] == '\r' || buf[len - 1] == '\n'))
+		buf[--len] = '\0';
+
+	return buf;
+}
+
+void uart_tx_submit(struct lrwanatd *lw, struct uart_tx *tx)
+{
+	STAILQ_INSERT_TAIL(&lw->uart.tx_q, tx, entries);
+
+	/* cb_write drains the queue once the fd is writable */
+	if (!event_pending(lw->event.uart_write, EV_WRITE, NULL))
+		event_add(lw->event.uart_write, NULL);
+}
+
+void uart_tx_free(struct lrwanatd *lw, struct uart_tx *tx)
+{
+	free(tx->heap);
+	pool_free(&lw->pool.uart_tx, tx);
+}
+
+/*	Returns RETURN_ERROR if a copy could not be made. The write is then
+ *	dropped, or cut short with a line end if the module has seen part of
+ *	it, and its command fails.
+ */
+int uart_tx_release(struct lrwanatd *lw, void *owner)
+{
+	struct uart_tx *tx, *tx_next;
+	char *buf, *sptr;
+	size_t len;
+	int i, ret = RETURN_OK;
+
+	/*	The owner is going away while its bytes are still queued.
+	 *	Copy what is left so the command is not cut in half on the wire.
 	 */
+	for (tx = STAILQ_FIRST(&lw->uart.tx_q); tx != NULL; tx = tx_next) {
+		tx_next = STAILQ_NEXT(tx, entries);
+		if (tx->owner != owner)
+			continue;
+
+		len = uart_tx_len(tx);
+		buf = sptr = malloc(len);
+		if (!buf) {
+			log(LOG_ERR, "cannot copy %zu bytes of a uart write: %s", len,
+					strerror(errno));
+			ret = RETURN_ERROR;
+			if (!tx->iov_idx && !tx->iov_off) {
+				STAILQ_REMOVE(&lw->uart.tx_q, tx, uart_tx, entries);
+				uart_tx_free(lw, tx);
+				continue;
+			}
+			/* A line left half written would garble the next command */
+			free(tx->heap);
+			tx->heap = NULL;
+			tx->iov[0].iov_base = UART_LINE_END;
+			tx->iov[0].iov_len = sizeof(UART_LINE_END) - 1;
+			tx->iovcnt = 1;
+			tx->iov_idx = 0;
+			tx->iov_off = 0;
+			tx->owner = NULL;
+			continue;
+		}
+		for (i = tx->iov_idx; i < tx->iovcnt; i++) {
+			size_t off = (i == tx->iov_idx) ? tx->iov_off : 0;
+			memcpy(sptr, (char *)tx->iov[i].iov_base + off, tx->iov[i].iov_len - off);
+			sptr += tx->iov[i].iov_len - off;
+		}
 
-	memcpy(lw->uart.buf + lw->uart.buf_len, buf, ret);
-	lw->uart.buf_len += ret;
+		free(tx->heap);
+		tx->heap = buf;
+		tx->iov[0].iov_base = buf;
+		tx->iov[0].iov_len = len;
+		tx->iovcnt = 1;
+		tx->iov_idx = 0;
+		tx->iov_off = 0;
+		tx->owner = NULL;
+	}
 
-	run_async_cmd(lw, lw->uart.buf, lw->uart.buf_len);
+	return ret;
+}
 
-	/* TODO: the cleaning part */
+int uart_write(struct lrwanatd *lw, char *buf, size_t len)
+{
+	/* buf is not copied, it has to outlive the write */
+	struct uart_tx *tx = uart_tx_new(lw, NULL);
 
-	set_http_client_uart_buf(lw, buf, ret);
+	if (!tx) {
+		log(LOG_ERR, "uart write of %zu bytes dropped, no uart writes left.", len);
+		return RETURN_ERROR;
+	}
+	if (uart_tx_add(tx, buf, len) == RETURN_ERROR) {
+		log(LOG_ERR, "uart write of %zu bytes dropped.", len);
+		uart_tx_free(lw, tx);
+		return RETURN_ERROR;
+	}
+	uart_tx_submit(lw, tx);
+	return len;
+}
+
+void remove_disconnected_clients(struct lrwanatd *lw)
+{
+	remove_disconnected_push_clients(lw);
+	remove_disconnected_http_clients(lw);
 }
-#endif
+
+/* Large enough to drain the tty input queue in a single read */
+#define READ_SIZE 512
 
 void uart_handle_post_read(struct lrwanatd *lw, char *buf, int buflen)
 {
 	/*	While reading, check for asynchronous events.
 	 *	Then clean the buffer. Then pass it to client if possible.
 	 */
-	memcpy(lw->uart.buf + lw->uart.buf_len, buf, buflen);
-	lw->uart.buf_len += buflen;
-	lw->uart.buf[lw->uart.buf_len] = '\0';
+	if (ringbuf_write(&lw->uart.rx, buf, buflen))
+		log(LOG_INFO, "uart rx buffer full, dropped oldest bytes.");
 
-	run_async_cmd(lw, lw->uart.buf, lw->uart.buf_len);
+	run_async_cmd(lw);
 
 	/* TODO: the cleaning part */
 
-	set_http_client_uart_buf(lw, buf, buflen);
+	set_sched_uart_buf(lw, buf, buflen);
 }
 
 
@@ -141,57 +265,140 @@ int uart_dev_read(evutil_socket_t fd, short what, void *arg)
 {
 	struct lrwanatd *lw;
 	char buf[READ_SIZE];
-	int ret;
+	ssize_t ret;
 
 	lw = (struct lrwanatd *)arg;
 
+	/*	Non blocking, returns whatever is queued in one syscall. -EAGAIN
+	 *	when there was nothing after all or the read was interrupted, 0
+	 *	at end of file and RETURN_ERROR, with errno set, when it failed.
+	 */
 	ret = read(fd, buf, READ_SIZE);
-	if (ret <= 0)
-		return 0;
-	else if(ret != 1) {
-		log(LOG_INFO, "read size = %d and not 1.", ret);
-		return 1;
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return RETURN_ERROR;
+		return -EAGAIN;
 	}
+	else if (ret == 0)
+		return 0;
 
+	/* Async events and the active command see the whole chunk at once */
 	uart_handle_post_read(lw, buf, ret);
 
 	return ret;
 }
 
+void cb_read(evutil_socket_t fd, short what, void *arg)
+{
+	struct lrwanatd *lw = (struct lrwanatd *)arg;
+	int ret, total = 0;
+
+	/* Persistent EV_READ, fires as soon as the module sends something */
+	while ((ret = uart_dev_read(fd, what, arg)) == READ_SIZE)
+		total += ret;
+
+	/* A spurious wakeup or an interrupted read, the next event retries */
+	if (ret == -EAGAIN)
+		return;
+
+	/* Readable with nothing to read, the tty hung up: unplugged, say */
+	if (ret < 0)
+		uart_dev_error(lw, "read", strerror(errno));
+	else if (!ret && !total)
+		uart_dev_error(lw, "read", "hung up");
+}
+
 void flush_dev_read(evutil_socket_t fd)
 {
-	int ret = 1;
 	char buf[READ_SIZE];
-	while (ret != 0) {
-		ret = read(fd, buf, READ_SIZE);
+	while (read(fd, buf, READ_SIZE) > 0)
+		;
+}
+
+void uart_tx_consume(struct lrwanatd *lw, size_t wlen)
+{
+	struct uart_tx *tx;
+	size_t left;
+
+	while ((tx = STAILQ_FIRST(&lw->uart.tx_q)) != NULL) {
+		while (tx->iov_idx < tx->iovcnt) {
+			left = tx->iov[tx->iov_idx].iov_len - tx->iov_off;
+			if (wlen < left) {
+				tx->iov_off += wlen;
+				return;
+			}
+			wlen -= left;
+			tx->iov_idx++;
+			tx->iov_off = 0;
+		}
+
+		STAILQ_REMOVE_HEAD(&lw->uart.tx_q, entries);
+		uart_tx_free(lw, tx);
+	}
+}
+
+/*	The device failed, EIO once it is unplugged say. The events stay ready
+ *	on a broken fd, so it is reopened rather than retried. What was queued
+ *	is dropped, the commands waiting on it time out.
+ */
+void uart_dev_error(struct lrwanatd *lw, const char *op, const char *reason)
+{
+	struct uart_tx *tx;
+
+	log(LOG_ERR, "uart %s failed: %s, reopening %s.", op, reason, lw->uart.file);
+	event_del(lw->event.uart_write);
+
+	while ((tx = STAILQ_FIRST(&lw->uart.tx_q)) != NULL) {
+		STAILQ_REMOVE_HEAD(&lw->uart.tx_q, entries);
+		uart_tx_free(lw, tx);
 	}
 
+	uart_reset(lw, true);
 }
 
-void uart_dev_write(evutil_socket_t fd, short what, void *arg)
+void cb_write(evutil_socket_t fd, short what, void *arg)
 {
 	struct lrwanatd *lw;
 	struct uart_tx *tx;
-	int wlen;
+	struct iovec iov[UART_WRITEV_MAX];
+	int i, iovcnt;
+	size_t len;
+	ssize_t wlen;
 
 	lw = (struct lrwanatd *)arg;
 
-	tx = STAILQ_FIRST(&lw->uart.tx_q);
-
-	if (!tx)
-		return;
-
-	// flush_dev_read(fd);
+	/* Gather the queue into one writev, resume partial writes on next EV_WRITE */
+	while (!STAILQ_EMPTY(&lw->uart.tx_q)) {
+		iovcnt = 0;
+		len = 0;
+		STAILQ_FOREACH(tx, &lw->uart.tx_q, entries) {
+			for (i = tx->iov_idx; i < tx->iovcnt && iovcnt < UART_WRITEV_MAX; i++) {
+				iov[iovcnt] = tx->iov[i];
+				if (i == tx->iov_idx) {
+					iov[iovcnt].iov_base = (char *)iov[iovcnt].iov_base + tx->iov_off;
+					iov[iovcnt].iov_len -= tx->iov_off;
+				}
+				len += iov[iovcnt].iov_len;
+				iovcnt++;
+			}
+			if (iovcnt == UART_WRITEV_MAX)
+				break;
+		}
 
-	wlen = write(lw->uart.fd, tx->buf, tx->buf_len);
-	tcdrain(lw->uart.fd);
+		wlen = writev(fd, iov, iovcnt);
+		if (wlen < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				uart_dev_error(lw, "write", strerror(errno));
+			return;
+		}
 
-	if (wlen != tx->buf_len)
-		log(LOG_INFO, "write to uart failed.");
-	else {
-		STAILQ_REMOVE_HEAD(&lw->uart.tx_q, entries);
-		free(tx);
+		uart_tx_consume(lw, wlen);
+		if (wlen < len)
+			return; /* partial write, tty output queue is full */
 	}
+
+	/* Nothing left, stop polling for writability */
+	event_del(lw->event.uart_write);
 }
 
 #if 0
@@ -247,15 +454,46 @@ bool uart_ready_write(struct lrwanatd *lw)
 
 #endif
 
+void setup_uart_fd_events(struct lrwanatd *lw)
+{
+	/* The fd changes on every reset, so the events are rebuilt each time */
+	if (lw->event.uart_read) {
+		event_del(lw->event.uart_read);
+		event_free(lw->event.uart_read);
+	}
+
+	if (lw->event.uart_write) {
+		event_del(lw->event.uart_write);
+		event_free(lw->event.uart_write);
+	}
+
+	lw->event.uart_read = event_new(lw->event.base, lw->uart.fd,
+			EV_READ|EV_PERSIST, cb_read, (void *)lw);
+	event_priority_set(lw->event.uart_read, 0);
+	event_add(lw->event.uart_read, NULL);
+
+	/* Only added while tx_q has data, see uart_tx_submit */
+	lw->event.uart_write = event_new(lw->event.base, lw->uart.fd,
+			EV_WRITE|EV_PERSIST, cb_write, (void *)lw);
+	event_priority_set(lw->event.uart_write, 1);
+
+	if (!STAILQ_EMPTY(&lw->uart.tx_q))
+		event_add(lw->event.uart_write, NULL);
+}
+
 void uart_reset(struct lrwanatd *lw, bool teardown)
 {
 	if (teardown) {
 		// uart_epoll_teardown(lw);
+		event_del(lw->event.uart_read);
+		event_del(lw->event.uart_write);
 		close(lw->uart.fd);
 		log(LOG_INFO, "closing %s.", lw->uart.file);
+		/* A line cut short by the old device must not prefix the next */
+		ringbuf_reset(&lw->uart.rx);
 	}
 	// open uart device
-	lw->uart.fd = open(lw->uart.file, O_RDWR, O_NOCTTY);
+	lw->uart.fd = open(lw->uart.file, O_RDWR | O_NOCTTY | O_NONBLOCK);
 	if(lw->uart.fd == -1) {
 		log(LOG_INFO, "error in opening %s.", lw->uart.file);
 		exit(EXIT_FAILURE);
@@ -264,93 +502,10 @@ void uart_reset(struct lrwanatd *lw, bool teardown)
 
 	set_interface_attribs(lw->uart.fd, BAUDRATE);
 	// uart_epoll_setup(lw);
+	setup_uart_fd_events(lw);
 }
 
 
-void process_cmd(evutil_socket_t fd, short what, void *arg)
-{
-	struct lrwanatd *lw;
-	struct http_client *client;
-	struct command *cmd;
-	char *buf;
-	size_t buflen;
-	int wlen, ret;
-
-	lw = (struct lrwanatd *)arg;
-
-	client = STAILQ_FIRST(lw->http.http_clientq_head);
-
-	if (client) {
-		if (client->state == HTTP_CLIENT_REQUEST_COMPLETE) {
-			cmd = STAILQ_FIRST(client->cmdq_head);
-
-			while(cmd && cmd->state != CMD_NEW) {
-				if (cmd->state == CMD_EXECUTING) {
-					return;
-				}
-				cmd = STAILQ_NEXT(cmd, entries);
-			}
-
-			if (cmd) {
-				assert(cmd->state == CMD_NEW);
-
-				buf = cmd->def.construct_cmd(cmd);
-				buflen = strlen(buf);
-
-				if (cmd->def.local_state) {
-					/* These commands run locally and not on the LoRa hardware */
-					cmd->state = CMD_EXECUTING;
-					uart_handle_post_read(lw, buf, buflen);
-				}
-				else {
-					log(LOG_INFO, "tx[len:%d]: %s", buflen, buf);
-					// str_to_hex(buf, buflen);
-
-					if (cmd->def.type == CMD_RESET)
-						uart_reset(lw, true);
-
-					if (uart_write(lw, buf, buflen) == RETURN_ERROR) {
-						cmd->state = CMD_ERROR;
-						free(buf);
-						return;
-					}
-
-					free(buf);
-
-					// Write enter key
-					if (uart_write(lw, "\r\n", 2) == RETURN_ERROR) {
-						cmd->state = CMD_ERROR;
-						return;
-					}
-					cmd->state = CMD_EXECUTING;
-				}
-			}
-		}
-	}
-}
-
-void uart_io(struct lrwanatd *lw)
-{
-	bool read = false;
-	/*
-	   while(uart_ready_read(lw)) {
-	   cb_read(lw->uart.fd, 0, lw);
-	   read = true;
-	   }
-
-	   if (!read && uart_ready_write(lw)) {
-	   uart_dev_write(lw->uart.fd, 0, lw);
-	   }
-	   */
-	while(uart_dev_read(lw->uart.fd, 0, lw) > 0) {
-		read = true;
-	}
-
-	if (!read) {
-		uart_dev_write(lw->uart.fd, 0, lw);
-	}
-}
-
 void cb_timer(evutil_socket_t fd, short what, void *arg);
 
 void setup_uart_loop_timer(struct lrwanatd *lw, bool isInit)
@@ -370,32 +525,18 @@ void cb_timer(evutil_socket_t fd, short what, void *arg)
 	struct lrwanatd *lw = (struct lrwanatd *)arg;
 
 	remove_disconnected_clients(lw);
-	process_http_clients(lw);
-	process_cmd(fd, what, arg);
-	//cb_write(fd, what, arg);
-	uart_io(lw);
+	/* Housekeeping only, commands complete on rx and deadline events */
+	schedule_cmds(lw);
 	setup_uart_loop_timer(lw, false);
 }
 
 void setup_uart_events(struct lrwanatd *lw)
 {
 	STAILQ_INIT(&lw->uart.tx_q);
+	ringbuf_init(&lw->uart.rx, lw->uart.rx_buf, UART_RX_BUF_SIZE);
 
-	/*
-	   lw->event.uart_read = event_new(lw->event.base, lw->uart.fd,
-	   EV_TIMEOUT|EV_READ|EV_PERSIST,
-	   cb_read, (void *)lw);
-	   event_priority_set(lw->event.uart_read, 0);
-
-	   lw->event.uart_write = event_new(lw->event.base, lw->uart.fd,
-	   EV_WRITE|EV_PERSIST,
-	   cb_write, (void *)lw);
-	   event_priority_set(lw->event.uart_write, 1);
-	   */
+	/* Opens the device and registers the uart_read and uart_write events */
 	uart_reset(lw, false);
 
 	setup_uart_loop_timer(lw, true);
-
-	//event_add(lw->event.uart_read, NULL);
-	// event_add(lw->event.uart_write, NULL);
 }
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 #include "util.h"
 #include "lorawanatd.h"
 
@@ -160,3 +161,12 @@ bool is_buffer_contains(char *buf, size_t buflen, const char *str)
 	free(tbuf);
 	return result;
 }
+
+/* Milliseconds on a clock that never jumps, for deadlines */
+uint64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,566 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+/*	AT_Slave firmware emulator.
+ *
+ *	Opens a pseudo terminal and answers the AT dialect lorawanatd speaks,
+ *	so the daemon can be run, tested and benchmarked without a Canarin
+ *	module. Point the daemon at the printed slave path with -f.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pty.h>
+#include <termios.h>
+
+#define LINE_MAX_LEN 2048
+#define OUT_QUEUE_LEN 64
+#define CMD_LATENCY_MAX 16
+#define CTX_MODULES 7
+
+/* Same strings as response[] in command.c */
+#define RES_OK "\r\nOK\r\n"
+#define RES_PARAM_ERROR "\r\nAT_PARAM_ERROR\r\n"
+#define RES_ERROR "\r\nAT_ERROR\r\n"
+#define RES_NO_NETWORK_JOINED "\r\nAT_NO_NETWORK_JOINED\r\n"
+
+#define MORE_TX_MSG "Network Server is asking for an uplink transmission\n\r"
+
+struct param {
+	const char *cmd;
+	char value[64];
+	long min; /* min == max means no range check */
+	long max;
+	bool read_only;
+};
+
+struct param params[] = {
+	{ "AT+DEUI", "00:80:e1:15:00:0a:b1:c2", 0, 0, true },
+	{ "AT+DADDR", "26:01:1b:3c", 0, 0, false },
+	{ "AT+APPKEY", "2b:7e:15:16:28:ae:d2:a6:ab:f7:15:88:09:cf:4f:3c", 0, 0, false },
+	{ "AT+NWKSKEY", "2b:7e:15:16:28:ae:d2:a6:ab:f7:15:88:09:cf:4f:3c", 0, 0, false },
+	{ "AT+APPSKEY", "2b:7e:15:16:28:ae:d2:a6:ab:f7:15:88:09:cf:4f:3c", 0, 0, false },
+	{ "AT+APPEUI", "01:01:01:01:01:01:01:01", 0, 0, false },
+	{ "AT+ADR", "1", 0, 1, false },
+	{ "AT+TXP", "0", 0, 5, false },
+	{ "AT+DR", "0", 0, 7, false },
+	{ "AT+RX2FQ", "923200000", 0, 0, false },
+	{ "AT+RX2DR", "2", 0, 7, false },
+	{ "AT+RX1DL", "1000", 0, 0, false },
+	{ "AT+RX2DL", "2000", 0, 0, false },
+	{ "AT+JN1DL", "5000", 0, 0, false },
+	{ "AT+JN2DL", "6000", 0, 0, false },
+	{ "AT+NJM", "1", 0, 1, false },
+	{ "AT+NWKID", "0", 0, 0, false },
+	{ "AT+CLASS", "A", 0, 0, false },
+	{ "AT+NJS", "0", 0, 0, true },
+	{ "AT+CFM", "0", 0, 1, false },
+	{ "AT+CFS", "0", 0, 0, true },
+	{ "AT+SNR", "0", 0, 0, true },
+	{ "AT+RSSI", "0", 0, 0, true },
+	{ "AT+FCNT", "0:0", 0, 0, false },
+};
+
+#define N_PARAMS (sizeof(params)/sizeof(params[0]))
+
+struct cmd_latency {
+	char cmd[32];
+	unsigned int ms;
+};
+
+/* Output waiting for its due time, keeps the responses in order */
+struct out_msg {
+	uint64_t due_us;
+	size_t len;
+	char buf[LINE_MAX_LEN + 128];
+};
+
+struct emu {
+	int master;
+	int slave;
+	bool verbose;
+	unsigned int baudrate; /* 0 disables pacing */
+	unsigned int latency_ms; /* default per command */
+	struct cmd_latency latency[CMD_LATENCY_MAX];
+	int n_latency;
+	unsigned int join_ms;
+	bool join_fail;
+	unsigned int downlink_ms; /* periodic downlink, 0 disables */
+	bool downlink_on_send;
+	bool more_tx;
+	unsigned int port;
+	const char *payload;
+	bool stamp;
+	uint64_t next_downlink_us;
+	uint64_t line_free_us; /* when the rx line towards the daemon is idle */
+	char ctx[CTX_MODULES][LINE_MAX_LEN];
+	struct out_msg out[OUT_QUEUE_LEN];
+	int out_head;
+	int out_count;
+	char in[LINE_MAX_LEN];
+	size_t in_len;
+	unsigned long n_cmds;
+	unsigned long n_downlinks;
+};
+
+volatile sig_atomic_t inject_downlink;
+volatile sig_atomic_t running = 1;
+
+uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Time the bytes spend on the wire, 10 bits per byte for 8N1 */
+uint64_t wire_us(struct emu *emu, size_t len)
+{
+	if (!emu->baudrate)
+		return 0;
+	return (uint64_t)len * 10 * 1000000 / emu->baudrate;
+}
+
+unsigned int cmd_latency_ms(struct emu *emu, const char *line)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; i < emu->n_latency; i++) {
+		len = strlen(emu->latency[i].cmd);
+		if (!strncmp(line, emu->latency[i].cmd, len) &&
+				(line[len] == '\0' || line[len] == '='))
+			return emu->latency[i].ms;
+	}
+	return emu->latency_ms;
+}
+
+void emit_at(struct emu *emu, uint64_t due_us, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+void emit_at(struct emu *emu, uint64_t due_us, const char *fmt, ...)
+{
+	struct out_msg *msg;
+	va_list args;
+	int n;
+
+	if (emu->out_count == OUT_QUEUE_LEN) {
+		fprintf(stderr, "output queue full, dropping message\n");
+		return;
+	}
+
+	msg = &emu->out[(emu->out_head + emu->out_count) % OUT_QUEUE_LEN];
+
+	va_start(args, fmt);
+	n = vsnprintf(msg->buf, sizeof(msg->buf), fmt, args);
+	va_end(args);
+	if (n < 0)
+		return;
+	msg->len = (size_t)n < sizeof(msg->buf) ? (size_t)n : sizeof(msg->buf) - 1;
+
+	/* Serialise on the line, a message can not overtake the previous one */
+	if (due_us < emu->line_free_us)
+		due_us = emu->line_free_us;
+	msg->due_us = due_us;
+	emu->line_free_us = due_us + wire_us(emu, msg->len);
+	emu->out_count++;
+}
+
+void emit_downlink(struct emu *emu, uint64_t due_us)
+{
+	const char *payload = emu->payload;
+	char stamp[17];
+
+	/* Monotonic time the downlink goes on the wire, for latency measurements */
+	if (emu->stamp) {
+		snprintf(stamp, sizeof(stamp), "%016llx", (unsigned long long)
+				(due_us > emu->line_free_us ? due_us : emu->line_free_us));
+		payload = stamp;
+	}
+
+	emit_at(emu, due_us, "+EVT:%u:%zu:%s\r\n+EVT:RX_1, DR 0, RSSI -%d, SNR %d\r\n",
+			emu->port, strlen(payload) / 2, payload,
+			40 + rand() % 60, rand() % 12);
+	if (emu->more_tx)
+		emit_at(emu, due_us, MORE_TX_MSG);
+	emu->n_downlinks++;
+}
+
+struct param *find_param(const char *cmd, size_t len)
+{
+	int i;
+
+	for (i = 0; i < N_PARAMS; i++)
+		if (strlen(params[i].cmd) == len && !strncmp(params[i].cmd, cmd, len))
+			return &params[i];
+	return NULL;
+}
+
+bool param_in_range(struct param *param, const char *value)
+{
+	char *end;
+	long v;
+
+	if (param->min == param->max)
+		return true;
+
+	errno = 0;
+	v = strtol(value, &end, 10);
+	return !errno && end != value && *end == '\0' &&
+		v >= param->min && v <= param->max;
+}
+
+void handle_ctx(struct emu *emu, const char *arg, uint64_t due)
+{
+	unsigned int type;
+	int i;
+
+	if (!strcmp(arg, "?")) {
+		/* Dump every module, the daemon keeps them in its context file */
+		for (i = 0; i < CTX_MODULES; i++)
+			emit_at(emu, due, "+CTX=%d:%s\r\n", i, emu->ctx[i]);
+		emit_at(emu, due, RES_OK);
+		return;
+	}
+
+	/* AT+CTX=[type]:[hex] */
+	if (sscanf(arg, "%u:", &type) != 1 || type >= CTX_MODULES || !strchr(arg, ':')) {
+		emit_at(emu, due, RES_PARAM_ERROR);
+		return;
+	}
+	snprintf(emu->ctx[type], sizeof(emu->ctx[type]), "%s", strchr(arg, ':') + 1);
+	emit_at(emu, due, RES_OK);
+}
+
+void handle_send(struct emu *emu, const char *arg, uint64_t due)
+{
+	struct param *njs = find_param("AT+NJS", 6);
+	unsigned int port, cfm;
+
+	/* AT+SEND=[port]:[confirmation_mode]:[data] */
+	if (sscanf(arg, "%u:%u:", &port, &cfm) != 2) {
+		emit_at(emu, due, RES_PARAM_ERROR);
+		return;
+	}
+
+	if (njs->value[0] != '1') {
+		emit_at(emu, due, RES_NO_NETWORK_JOINED);
+		return;
+	}
+
+	emit_at(emu, due, RES_OK);
+
+	/* Class A, the downlink shows up in the rx windows after the uplink */
+	if (emu->downlink_on_send)
+		emit_downlink(emu, due + 1000 * 1000);
+}
+
+void handle_line(struct emu *emu, char *line, uint64_t arrived_us)
+{
+	struct param *param;
+	char *eq;
+	uint64_t due;
+
+	if (emu->verbose)
+		fprintf(stderr, "rx: %s\n", line);
+
+	emu->n_cmds++;
+	due = arrived_us + (uint64_t)cmd_latency_ms(emu, line) * 1000;
+
+	if (!strcmp(line, "AT")) {
+		emit_at(emu, due, RES_OK);
+		return;
+	}
+
+	if (!strcmp(line, "ATZ")) {
+		/* Soft reset forgets the join, contexts survive in NVM */
+		snprintf(find_param("AT+NJS", 6)->value, sizeof(params[0].value), "0");
+		emit_at(emu, due, "\r\nAT_Slave emulator\r\n");
+		return;
+	}
+
+	eq = strchr(line, '=');
+	if (strncmp(line, "AT+", 3) || !eq) {
+		emit_at(emu, due, RES_ERROR);
+		return;
+	}
+	*eq++ = '\0';
+
+	if (!strcmp(line, "AT+JOIN")) {
+		emit_at(emu, due, RES_OK);
+		if (emu->join_fail)
+			emit_at(emu, due + (uint64_t)emu->join_ms * 1000, "+EVT:JOIN FAILED\r\n");
+		else {
+			snprintf(find_param("AT+NJS", 6)->value, sizeof(params[0].value), "1");
+			emit_at(emu, due + (uint64_t)emu->join_ms * 1000, "+EVT:JOINED\r\n");
+		}
+		return;
+	}
+
+	if (!strcmp(line, "AT+CTX")) {
+		handle_ctx(emu, eq, due);
+		return;
+	}
+
+	if (!strcmp(line, "AT+SEND")) {
+		handle_send(emu, eq, due);
+		return;
+	}
+
+	param = find_param(line, strlen(line));
+	if (!param) {
+		emit_at(emu, due, RES_ERROR);
+		return;
+	}
+
+	if (!strcmp(eq, "?")) {
+		emit_at(emu, due, "%s\r\n" RES_OK, param->value);
+		return;
+	}
+
+	if (param->read_only || !param_in_range(param, eq)) {
+		emit_at(emu, due, RES_PARAM_ERROR);
+		return;
+	}
+
+	snprintf(param->value, sizeof(param->value), "%s", eq);
+	emit_at(emu, due, RES_OK);
+}
+
+void handle_input(struct emu *emu)
+{
+	char buf[512];
+	ssize_t len;
+	size_t i;
+	uint64_t now;
+
+	len = read(emu->master, buf, sizeof(buf));
+	if (len <= 0)
+		return;
+
+	now = now_us();
+
+	for (i = 0; i < (size_t)len; i++) {
+		if (buf[i] == '\r' || buf[i] == '\n') {
+			if (!emu->in_len)
+				continue;
+			emu->in[emu->in_len] = '\0';
+			/* The command is complete once its last byte is off the wire */
+			handle_line(emu, emu->in, now + wire_us(emu, emu->in_len + 2));
+			emu->in_len = 0;
+		}
+		else if (emu->in_len < sizeof(emu->in) - 1)
+			emu->in[emu->in_len++] = buf[i];
+	}
+}
+
+/* Writes due messages, returns the poll timeout in ms until the next one */
+int flush_output(struct emu *emu)
+{
+	struct out_msg *msg;
+	uint64_t now = now_us(), wait_us;
+	ssize_t wlen;
+
+	while (emu->out_count) {
+		msg = &emu->out[emu->out_head];
+		if (msg->due_us > now) {
+			wait_us = msg->due_us - now;
+			return (int)((wait_us + 999) / 1000);
+		}
+
+		wlen = write(emu->master, msg->buf, msg->len);
+		if (wlen < 0) {
+			if (errno == EAGAIN)
+				return 1;
+			fprintf(stderr, "write failed: %s\n", strerror(errno));
+			wlen = msg->len;
+		}
+
+		if ((size_t)wlen < msg->len) {
+			memmove(msg->buf, msg->buf + wlen, msg->len - wlen);
+			msg->len -= wlen;
+			return 1;
+		}
+
+		emu->out_head = (emu->out_head + 1) % OUT_QUEUE_LEN;
+		emu->out_count--;
+	}
+	return -1;
+}
+
+void on_sigusr1(int signum)
+{
+	inject_downlink = 1;
+}
+
+void on_sigterm(int signum)
+{
+	running = 0;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr,
+			"usage: %s [options]\n"
+			"  -o path     symlink the pty slave to path\n"
+			"  -b baud     pace output at baud, 8N1 (default 9600, 0 = off)\n"
+			"  -l ms       default command latency (default 10)\n"
+			"  -c CMD=ms   latency for one command, e.g. AT+JOIN=3000 (repeatable)\n"
+			"  -j ms       time until +EVT:JOINED (default 2000)\n"
+			"  -J          joins fail with +EVT:JOIN FAILED\n"
+			"  -d ms       inject a downlink every ms\n"
+			"  -s          inject a downlink after every AT+SEND\n"
+			"  -m          follow downlinks with the uplink request notice\n"
+			"  -p port     downlink port (default 2)\n"
+			"  -x hex      downlink payload (default aabbccdd)\n"
+			"  -t          payload is the CLOCK_MONOTONIC send time in us, hex\n"
+			"  -v          print received commands\n"
+			"SIGUSR1 injects a downlink immediately.\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct emu *emu;
+	struct termios tty;
+	struct pollfd pfd;
+	const char *link_path = NULL;
+	char name[256], *sep;
+	int opt, timeout;
+	uint64_t now;
+
+	emu = calloc(1, sizeof(struct emu));
+	emu->baudrate = 9600;
+	emu->latency_ms = 10;
+	emu->join_ms = 2000;
+	emu->port = 2;
+	emu->payload = "aabbccdd";
+
+	while ((opt = getopt(argc, argv, "o:b:l:c:j:Jd:smp:x:tvh")) != -1) {
+		switch (opt) {
+			case 'o':
+				link_path = optarg;
+				break;
+			case 'b':
+				emu->baudrate = strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				emu->latency_ms = strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				sep = strrchr(optarg, '=');
+				if (!sep || emu->n_latency == CMD_LATENCY_MAX ||
+						sep - optarg >= sizeof(emu->latency[0].cmd)) {
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				snprintf(emu->latency[emu->n_latency].cmd,
+						sizeof(emu->latency[0].cmd), "%.*s",
+						(int)(sep - optarg), optarg);
+				emu->latency[emu->n_latency++].ms = strtoul(sep + 1, NULL, 10);
+				break;
+			case 'j':
+				emu->join_ms = strtoul(optarg, NULL, 10);
+				break;
+			case 'J':
+				emu->join_fail = true;
+				break;
+			case 'd':
+				emu->downlink_ms = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				emu->downlink_on_send = true;
+				break;
+			case 'm':
+				emu->more_tx = true;
+				break;
+			case 'p':
+				emu->port = strtoul(optarg, NULL, 10);
+				break;
+			case 'x':
+				emu->payload = optarg;
+				break;
+			case 't':
+				emu->stamp = true;
+				break;
+			case 'v':
+				emu->verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (openpty(&emu->master, &emu->slave, name, NULL, NULL) < 0) {
+		fprintf(stderr, "openpty failed: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Raw line discipline, the daemon sees exactly the bytes we write */
+	tcgetattr(emu->slave, &tty);
+	cfmakeraw(&tty);
+	tcsetattr(emu->slave, TCSANOW, &tty);
+
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(name, link_path) < 0) {
+			fprintf(stderr, "symlink %s failed: %s\n", link_path, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%s\n", link_path ? link_path : name);
+	fflush(stdout);
+
+	signal(SIGUSR1, on_sigusr1);
+	signal(SIGTERM, on_sigterm);
+	signal(SIGINT, on_sigterm);
+
+	if (emu->downlink_ms)
+		emu->next_downlink_us = now_us() + (uint64_t)emu->downlink_ms * 1000;
+
+	pfd.fd = emu->master;
+	pfd.events = POLLIN;
+
+	while (running) {
+		timeout = flush_output(emu);
+
+		now = now_us();
+		if (inject_downlink) {
+			inject_downlink = 0;
+			emit_downlink(emu, now);
+			timeout = 0;
+		}
+		if (emu->downlink_ms && now >= emu->next_downlink_us) {
+			emit_downlink(emu, now);
+			emu->next_downlink_us = now + (uint64_t)emu->downlink_ms * 1000;
+			timeout = 0;
+		}
+		if (emu->downlink_ms) {
+			int dl = (int)((emu->next_downlink_us - now) / 1000);
+			if (timeout < 0 || dl < timeout)
+				timeout = dl;
+		}
+
+		if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN))
+			handle_input(emu);
+	}
+
+	fprintf(stderr, "commands: %lu, downlinks: %lu\n", emu->n_cmds, emu->n_downlinks);
+
+	if (link_path)
+		unlink(link_path);
+	close(emu->master);
+	close(emu->slave);
+	free(emu);
+
+	return EXIT_SUCCESS;
+}
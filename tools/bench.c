@@ -0,0 +1,347 @@
+/* vim: set autoindent noexpandtab tabstop=4 shiftwidth=4 */
+
+/*	Microbenchmarks for the parsing hot paths.
+ *
+ *	Each benchmark runs over a small corpus recorded from daemon sessions
+ *	against tools/atslave_emu and reports ns/op and allocs/op. Allocations
+ *	are counted by interposing the glibc allocator, so anything libc
+ *	allocates on behalf of the code under test (regexec, fopen) counts too,
+ *	taking an object from a pool does not.
+ *	Run with `make bench`, the numbers follow the configured CFLAGS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lorawanatd.h"
+#include "http.h"
+#include "command.h"
+#include "context_manager.h"
+#include "picohttpparser.h"
+#include "util.h"
+#include "scheduler.h"
+
+#define BENCH_MIN_NS 200000000ULL /* run each benchmark for at least 0.2s */
+
+struct lrwanatd *global_lw;
+
+/* Allocation counting */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+unsigned long n_allocs;
+
+void *malloc(size_t size)
+{
+	n_allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	n_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	n_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+/* Corpora */
+const char *http_corpus[] = {
+	"POST /config/get HTTP/1.1\r\nHost: 127.0.0.1:5555\r\n"
+	"User-Agent: python-requests/2.28.1\r\nAccept-Encoding: gzip, deflate\r\n"
+	"Accept: */*\r\nConnection: keep-alive\r\nContent-Type: application/json\r\n"
+	"Content-Length: 45\r\n\r\n[\"data_rate\", \"class\", \"adaptive_data_rate\"]",
+	"GET /status HTTP/1.1\r\nHost: localhost:5555\r\nUser-Agent: curl/7.88.1\r\n"
+	"Accept: */*\r\n\r\n",
+	"POST /sendb HTTP/1.1\r\nHost: 127.0.0.1:5555\r\n"
+	"User-Agent: python-requests/2.28.1\r\nAccept-Encoding: gzip, deflate\r\n"
+	"Accept: */*\r\nConnection: keep-alive\r\nContent-Type: application/json\r\n"
+	"Content-Length: 39\r\n\r\n{ \"data\" : \"aabbccddee\", \"port\" : 21 }",
+};
+
+/* Request lines, the last ones match no route */
+const char *route_corpus[][2] = {
+	{ "POST", "/config/get" },
+	{ "GET", "/status" },
+	{ "POST", "/sendb" },
+	{ "GET", "/force_update" },
+	{ "GET", "/s" },
+	{ "POST", "/config/gets" },
+};
+
+struct json_sample {
+	enum http_action action;
+	const char *body;
+};
+
+struct json_sample json_corpus[] = {
+	{ HTTP_GET_CONFIG, "[\"data_rate\", \"device_eui\", \"class\", \"adaptive_data_rate\", \"network_join_mode\"]" },
+	{ HTTP_SET_CONFIG, "{\"network_join_mode\": \"1\", \"application_eui\": \"12:12:12:12:12:12:12:12\", "
+		"\"adaptive_data_rate\": \"0\", \"data_rate\": \"5\", \"transmit_power\": \"5\"}" },
+	{ HTTP_SENDB_DATA, "{ \"data\" : \"aabbccddee\", \"port\" : 21 }" },
+	{ HTTP_SEND_DATA, "{\"data\": \"hello\", \"port\": 21}" },
+};
+
+/* Payload line followed by its RX_n line, as the firmware sends them */
+const char *downlink_corpus[][2] = {
+	{ "+EVT:2:4:aabbccdd", "+EVT:RX_1, DR 0, RSSI -50, SNR 7" },
+	{ "+EVT:21:16:00112233445566778899aabbccddeeff", "+EVT:RX_2, DR 2, RSSI -103, SNR -4" },
+	{ "+EVT:3:8:000000005c12e592", "+EVT:RX_1, DR 5, RSSI -61, SNR 10" },
+};
+
+/* Raw command buffers as accumulated from the uart */
+const char *uart_corpus[] = {
+	"\r\nOK\r\n",
+	"5\r\n\r\nOK\r\n",
+	"00:80:e1:15:00:0a:b1:c2\r\n\r\nOK\r\n",
+	"\r\nAT_PARAM_ERROR\r\n",
+	"\r\nOK\r\n+EVT:JOINED\r\n",
+};
+
+/* Executed gets and the module's answers, as replied by /config/get */
+const char *reply_corpus[][2] = {
+	{ "data_rate", "5\r\n\r\nOK\r\n" },
+	{ "device_eui", "00:80:e1:15:00:0a:b1:c2\r\n\r\nOK\r\n" },
+	{ "class", "A\r\n\r\nOK\r\n" },
+	{ "rx2_frequency", "869525000\r\n\r\nOK\r\n" },
+	{ "snr", "\r\nAT_BUSY_ERROR\r\n" },
+};
+
+const char *ctx_corpus =
+	"+CTX=0:0a1b2c3d4e5f60718293a4b5c6d7e8f90a1b2c3d4e5f60718293a4b5c6d7e8f90a1b2c3d4e5f6071\r\n"
+	"+CTX=1:00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff\r\n"
+	"+CTX=2:2b7e151628aed2a6abf7158809cf4f3c2b7e151628aed2a6abf7158809cf4f3c\r\n"
+	"+CTX=3:0101010101010101\r\n"
+	"+CTX=4:00\r\n"
+	"+CTX=5:00\r\n"
+	"+CTX=6:00\r\n"
+	"\r\nOK\r\n";
+
+#define CORPUS_LEN(c) (sizeof(c) / sizeof((c)[0]))
+
+struct http_client *bench_client;
+struct http_client *reply_client;
+struct command *bench_cmd;
+int devnull;
+
+/* Benchmarks, i picks the corpus sample */
+void bench_phr_parse_request(size_t i)
+{
+	const char *req = http_corpus[i % CORPUS_LEN(http_corpus)];
+	const char *method, *path;
+	size_t method_len, path_len, num_headers;
+	struct phr_header headers[48];
+	int minor_version;
+
+	num_headers = sizeof(headers) / sizeof(headers[0]);
+	phr_parse_request(req, strlen(req), &method, &method_len, &path, &path_len,
+			&minor_version, headers, &num_headers, 0);
+}
+
+void bench_http_route_lookup(size_t i)
+{
+	const char **sample = route_corpus[i % CORPUS_LEN(route_corpus)];
+
+	bench_client->request.method = (char *)sample[0];
+	bench_client->request.method_len = strlen(sample[0]);
+	bench_client->request.path = (char *)sample[1];
+	bench_client->request.path_len = strlen(sample[1]);
+	get_action_from_http_request(bench_client);
+}
+
+void bench_parse_json_content_add_cmd(size_t i)
+{
+	struct json_sample *sample = &json_corpus[i % CORPUS_LEN(json_corpus)];
+	struct command *cmd;
+
+	bench_client->action = sample->action;
+	bench_client->request.content = (char *)sample->body;
+	bench_client->request.content_len = strlen(sample->body);
+	parse_json_content_add_cmd(bench_client);
+
+	while ((cmd = STAILQ_FIRST(bench_client->cmdq_head))) {
+		STAILQ_REMOVE_HEAD(bench_client->cmdq_head, entries);
+		pool_free(&global_lw->pool.cmd, cmd);
+	}
+}
+
+char regex_buf[2 * ASYNC_LINE_MAX + 8];
+
+void bench_async_recv_regex(size_t i)
+{
+	regmatch_t match[global_lw->regex.n_recv_grps];
+	size_t n = i % CORPUS_LEN(downlink_corpus);
+
+	snprintf(regex_buf, sizeof(regex_buf), "%s\r\n%s\r\n",
+			downlink_corpus[n][0], downlink_corpus[n][1]);
+	regexec(&global_lw->regex.recv, regex_buf, global_lw->regex.n_recv_grps, match, 0);
+}
+
+void bench_async_recv_scan(size_t i)
+{
+	const char **sample = downlink_corpus[i % CORPUS_LEN(downlink_corpus)];
+	struct async_evt evt;
+
+	scan_evt_payload(sample[0], strlen(sample[0]), &evt);
+	scan_evt_rx(sample[1], strlen(sample[1]), &evt);
+}
+
+void bench_is_buffer_contains(size_t i)
+{
+	const char *buf = uart_corpus[i % CORPUS_LEN(uart_corpus)];
+
+	is_buffer_contains((char *)buf, strlen(buf), "OK");
+}
+
+char trim_buf[256];
+
+void bench_trim(size_t i)
+{
+	const char *buf = uart_corpus[i % CORPUS_LEN(uart_corpus)];
+	size_t len = strlen(buf);
+
+	/* trim works in place */
+	memcpy(trim_buf, buf, len + 1);
+	trim(trim_buf, &len);
+}
+
+char reply_buf[8192];
+
+void bench_reply_cmds_json(size_t i)
+{
+	reply_cmds_json(reply_client, reply_buf, reply_cmds_json_max(reply_client));
+}
+
+void bench_context_acquired(size_t i)
+{
+	context_acquired(bench_cmd);
+}
+
+struct bench {
+	const char *name;
+	void (*run)(size_t i);
+};
+
+struct bench benches[] = {
+	{ "phr_parse_request", bench_phr_parse_request },
+	{ "http_route_lookup", bench_http_route_lookup },
+	{ "parse_json_content_add_cmd", bench_parse_json_content_add_cmd },
+	{ "async_recv_regex", bench_async_recv_regex },
+	{ "async_recv_scan", bench_async_recv_scan },
+	{ "is_buffer_contains", bench_is_buffer_contains },
+	{ "trim", bench_trim },
+	{ "reply_cmds_json", bench_reply_cmds_json },
+	{ "context_acquired", bench_context_acquired },
+};
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void run_bench(struct bench *bench)
+{
+	unsigned long long start, elapsed;
+	unsigned long allocs;
+	size_t i, iters = 1;
+
+	/* Double the iterations until the run is long enough to time */
+	for (;;) {
+		allocs = n_allocs;
+		start = now_ns();
+		for (i = 0; i < iters; i++)
+			bench->run(i);
+		elapsed = now_ns() - start;
+		allocs = n_allocs - allocs;
+		if (elapsed >= BENCH_MIN_NS)
+			break;
+		iters *= 2;
+	}
+
+	fprintf(stderr, "%-28s %10zu %12.1f ns/op %8.2f allocs/op\n", bench->name,
+			iters, (double)elapsed / iters, (double)allocs / iters);
+}
+
+int init_bench()
+{
+	struct command *cmd;
+	size_t i;
+
+	global_lw = calloc(1, sizeof(struct lrwanatd));
+	global_lw->http.http_clientq_head = init_http_client_queue();
+	STAILQ_INIT(&global_lw->uart.tx_q);
+	init_scheduler(global_lw);
+
+	if (init_regex(global_lw) == RETURN_ERROR ||
+			init_cmd_defs() == RETURN_ERROR ||
+			init_http_routes() == RETURN_ERROR ||
+			init_pools(global_lw) == RETURN_ERROR)
+		return RETURN_ERROR;
+
+	/* Contexts are written on every acquire, keep them off the disk */
+	strcpy(global_lw->ctx_mngr.filename, "/dev/null");
+	context_manager_init(&global_lw->ctx_mngr);
+
+	bench_client = create_http_client(global_lw, 0);
+	bench_client->local = true;
+
+	reply_client = create_http_client(global_lw, 0);
+	reply_client->local = true;
+	for (i = 0; i < CORPUS_LEN(reply_corpus); i++) {
+		cmd = make_cmd((char *)reply_corpus[i][0], strlen(reply_corpus[i][0]),
+				NULL, 0, CMD_GET);
+		if (!cmd)
+			return RETURN_ERROR;
+		cmd->state = CMD_EXECUTING;
+		set_cmd_uart_buf(cmd, (char *)reply_corpus[i][1], strlen(reply_corpus[i][1]));
+		cmd->state = CMD_EXECUTED;
+		STAILQ_INSERT_TAIL(reply_client->cmdq_head, cmd, entries);
+	}
+
+	bench_cmd = make_type_cmd(CMD_ACQUIRE_CONTEXT, NULL, 0);
+	if (!bench_cmd)
+		return RETURN_ERROR;
+	bench_cmd->buf_len = strlen(ctx_corpus);
+	memcpy(bench_cmd->buf, ctx_corpus, bench_cmd->buf_len + 1);
+
+	return RETURN_OK;
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	/* Logs and debug prints of the code under test go to stdout */
+	devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+
+	if (init_bench()) {
+		fprintf(stderr, "cannot initialise benchmarks\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < CORPUS_LEN(benches); i++)
+		if (argc < 2 || strstr(benches[i].name, argv[1]))
+			run_bench(&benches[i]);
+
+	pool_free(&global_lw->pool.cmd, bench_cmd);
+	destroy_http_client(global_lw, bench_client);
+	destroy_http_client(global_lw, reply_client);
+	regfree(&global_lw->regex.recv);
+	destroy_pools(global_lw);
+	free(global_lw->http.http_clientq_head);
+	free(global_lw);
+	close(devnull);
+
+	return EXIT_SUCCESS;
+}